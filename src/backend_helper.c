@@ -6,9 +6,10 @@
 #include <stdlib.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <glib/gstdio.h>
 #include <cupsfilters/ipp.h>
 
-#define MAX_ADDRESSES 10 
 #define _CUPS_NO_DEPRECATED 1
 
 static http_t *system_conn = NULL;
@@ -27,7 +28,40 @@ char *get_printer_name_for_cups_dest(const cups_dest_t *dest)
     return g_strdup(dest->name);
 }
 
+/** Read a non-negative number from the environment **/
+static guint64 env_get_number(const char *name, guint64 default_value)
+{
+    const char *val = g_getenv(name);
+    char *end;
+    guint64 n;
+
+    if (val == NULL || val[0] == '\0')
+        return default_value;
+    n = g_ascii_strtoull(val, &end, 10);
+    if (*end != '\0')
+    {
+        logwarn("Ignoring invalid value '%s' of %s\n", val, name);
+        return default_value;
+    }
+    return n;
+}
+
+/** Read a boolean setting from the environment **/
+static gboolean env_get_boolean(const char *name, gboolean default_value)
+{
+    const char *val = g_getenv(name);
+
+    if (val == NULL || val[0] == '\0')
+        return default_value;
+    return (g_ascii_strcasecmp(val, "yes") == 0 ||
+            g_ascii_strcasecmp(val, "true") == 0 ||
+            g_ascii_strcasecmp(val, "on") == 0 ||
+            strcmp(val, "1") == 0);
+}
+
 /*****************BackendObj********************************/
+static void prefetch_worker(gpointer data, gpointer user_data);
+
 BackendObj *get_new_BackendObj()
 {
     map = get_new_Mappings();
@@ -40,9 +74,254 @@ BackendObj *get_new_BackendObj()
     b->num_frontends = 0;
     b->obj_path = NULL;
     b->default_printer = NULL;
+    b->printer_snapshot = NULL;
+    b->snapshot_generation = 0;
+    b->snapshot_enumerating = FALSE;
+    b->snapshot_waiters = NULL;
+    b->snapshot_revalidating = FALSE;
+    b->stream_listing = env_get_boolean("CPDB_CUPS_STREAM_LISTING", FALSE);
+    b->capabilities = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            (GDestroyNotify)free_string,
+                                            (GDestroyNotify)unref_PrinterCapabilities);
+    b->models = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                      (GDestroyNotify)unref_PrinterCapabilities);
+    b->cache_save_source = 0;
+    b->linger_timeout = env_get_number("CPDB_CUPS_LINGER_TIMEOUT", DEFAULT_LINGER_TIMEOUT);
+    b->linger_max_memory = env_get_number("CPDB_CUPS_LINGER_MAX_MEMORY",
+                                          DEFAULT_LINGER_MAX_MEMORY) * 1024 * 1024;
+    b->linger_source = 0;
+
+    int prefetch_threads = MIN(env_get_number("CPDB_CUPS_PREFETCH_THREADS", DEFAULT_PREFETCH_THREADS),
+                               MAX_PREFETCH_THREADS);
+    const char *prefetch_printers = g_getenv("CPDB_CUPS_PREFETCH_PRINTERS");
+    b->prefetch_pool = NULL;
+    if (prefetch_threads > 0)
+        b->prefetch_pool = g_thread_pool_new(prefetch_worker, NULL, prefetch_threads, FALSE, NULL);
+    b->prefetch_count = MIN(env_get_number("CPDB_CUPS_PREFETCH_COUNT", DEFAULT_PREFETCH_COUNT),
+                            G_MAXUINT);
+    b->prefetch_printers = g_strsplit(prefetch_printers ? prefetch_printers : "", ",", -1);
+    b->prefetching = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    b->capabilities_generation = 0;
+    b->usage = g_key_file_new();
+    b->usage_save_source = 0;
     return b;
 }
 
+typedef struct _SnapshotWaiter
+{
+    SnapshotReadyFunc func;
+    gpointer user_data;
+    guint generation;
+} SnapshotWaiter;
+
+static void start_snapshot_enumeration(BackendObj *b);
+static void refresh_all_printer_lists_cb(BackendObj *b, GHashTable *snapshot, gpointer user_data);
+
+GHashTable *fetch_config_stamps(const char *queue_name)
+{
+    static const char *const requested_attributes[] = {"printer-name",
+                                                       "printer-config-change-time"};
+    GHashTable *stamps = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    ipp_t *request, *response;
+    ipp_attribute_t *attr;
+    const char *name;
+    int stamp;
+
+    request = ippNewRequest(IPP_OP_CUPS_GET_PRINTERS);
+    ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "requested-attributes",
+                  G_N_ELEMENTS(requested_attributes), NULL, requested_attributes);
+    if (queue_name)
+    {
+        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME, "first-printer-name",
+                     NULL, queue_name);
+        ippAddInteger(request, IPP_TAG_OPERATION, IPP_TAG_INTEGER, "limit", 1);
+    }
+
+    response = cupsDoRequest(CUPS_HTTP_DEFAULT, request, "/");
+    if (response == NULL)
+    {
+        logdebug("Unable to get the config change times: %s\n", cupsLastErrorString());
+        return stamps;
+    }
+
+    for (attr = ippFirstAttribute(response); attr != NULL; attr = ippNextAttribute(response))
+    {
+        while (attr && ippGetGroupTag(attr) != IPP_TAG_PRINTER)
+            attr = ippNextAttribute(response);
+        if (attr == NULL)
+            break;
+
+        name = NULL;
+        stamp = -1;
+        for (; attr && ippGetGroupTag(attr) == IPP_TAG_PRINTER; attr = ippNextAttribute(response))
+        {
+            if (strcmp(ippGetName(attr), "printer-name") == 0 &&
+                ippGetValueTag(attr) == IPP_TAG_NAME)
+                name = ippGetString(attr, 0, NULL);
+            else if (strcmp(ippGetName(attr), "printer-config-change-time") == 0 &&
+                     ippGetValueTag(attr) == IPP_TAG_INTEGER)
+                stamp = ippGetInteger(attr, 0);
+        }
+        if (name && stamp >= 0)
+            g_hash_table_replace(stamps, g_strdup(name), g_strdup_printf("%d", stamp));
+        if (attr == NULL)
+            break;
+    }
+    ippDelete(response);
+    return stamps;
+}
+
+void set_config_stamps(GHashTable *printers, GHashTable *stamps)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, printers);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        PrinterEntry *e = value;
+        g_free(e->config_stamp);
+        e->config_stamp = g_strdup(g_hash_table_lookup(stamps, e->dest->name));
+    }
+}
+
+static int add_printer_entry_to_ht(void *user_data, unsigned flags, cups_dest_t *dest)
+{
+    GHashTable *h = (GHashTable *)user_data;
+    PrinterEntry *e = get_new_PrinterEntry(dest);
+    if (e)
+        g_hash_table_insert(h, get_printer_name_for_cups_dest(dest), e);
+    return 1;
+}
+
+/* Runs on a worker thread, must not touch the BackendObj */
+static void enumerate_printers_thread(GTask *task,
+                                      gpointer source_object,
+                                      gpointer task_data,
+                                      GCancellable *cancellable)
+{
+    GHashTable *stamps;
+
+    logdebug("Enumerating CUPS destinations for the printer snapshot\n");
+    GHashTable *printers_ht = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                    (GDestroyNotify)free_string,
+                                                    (GDestroyNotify)unref_PrinterEntry);
+    cupsEnumDests(CUPS_DEST_FLAGS_NONE,
+                  3000,                    //timeout
+                  NULL,                    //cancel
+                  0,                       //TYPE
+                  0,                       //MASK
+                  add_printer_entry_to_ht, //function
+                  printers_ht);            //user_data
+
+    stamps = fetch_config_stamps(NULL);
+    set_config_stamps(printers_ht, stamps);
+    g_hash_table_unref(stamps);
+
+    g_task_return_pointer(task, printers_ht, (GDestroyNotify)g_hash_table_unref);
+}
+
+static void snapshot_enumerated_cb(GObject *source_object,
+                                   GAsyncResult *res,
+                                   gpointer user_data)
+{
+    BackendObj *b = user_data;
+    guint generation = GPOINTER_TO_UINT(g_task_get_task_data(G_TASK(res)));
+    GHashTable *table = g_task_propagate_pointer(G_TASK(res), NULL);
+    GList *waiters, *l, *pending = NULL;
+    gboolean revalidated = FALSE;
+
+    b->snapshot_enumerating = FALSE;
+    if (generation == b->snapshot_generation)
+    {
+        if (b->printer_snapshot && b->snapshot_revalidating)
+        {
+            g_hash_table_unref(b->printer_snapshot);
+            b->printer_snapshot = NULL;
+            revalidated = TRUE;
+        }
+        if (b->printer_snapshot == NULL)
+        {
+            b->printer_snapshot = g_hash_table_ref(table);
+            schedule_backend_cache_save(b);
+        }
+    }
+    b->snapshot_revalidating = FALSE;
+
+    /** Serve everyone who asked before this enumeration was started;
+     * requests made after an invalidation need a fresh enumeration **/
+    waiters = b->snapshot_waiters;
+    b->snapshot_waiters = NULL;
+    for (l = waiters; l != NULL; l = l->next)
+    {
+        SnapshotWaiter *w = l->data;
+        if (w->generation != generation)
+        {
+            pending = g_list_append(pending, w);
+            continue;
+        }
+        w->func(b, table, w->user_data);
+        g_free(w);
+    }
+    g_list_free(waiters);
+    if (revalidated)
+        refresh_all_printer_lists_cb(b, table, NULL);
+    g_hash_table_unref(table);
+
+    b->snapshot_waiters = g_list_concat(pending, b->snapshot_waiters);
+    if (b->snapshot_waiters && !b->snapshot_enumerating)
+        start_snapshot_enumeration(b);
+}
+
+static void start_snapshot_enumeration(BackendObj *b)
+{
+    GTask *task = g_task_new(NULL, NULL, snapshot_enumerated_cb, b);
+    g_task_set_task_data(task, GUINT_TO_POINTER(b->snapshot_generation), NULL);
+    b->snapshot_enumerating = TRUE;
+    g_task_run_in_thread(task, enumerate_printers_thread);
+    g_object_unref(task);
+}
+
+void request_printer_snapshot(BackendObj *b, SnapshotReadyFunc func, gpointer user_data)
+{
+    if (b->printer_snapshot)
+    {
+        func(b, b->printer_snapshot, user_data);
+        return;
+    }
+
+    SnapshotWaiter *w = g_new(SnapshotWaiter, 1);
+    w->func = func;
+    w->user_data = user_data;
+    w->generation = b->snapshot_generation;
+    b->snapshot_waiters = g_list_append(b->snapshot_waiters, w);
+
+    if (!b->snapshot_enumerating)
+        start_snapshot_enumeration(b);
+}
+
+void invalidate_printer_snapshot(BackendObj *b)
+{
+    b->snapshot_generation++;
+    if (b->printer_snapshot == NULL)
+        return;
+
+    logdebug("Invalidating printer snapshot\n");
+    g_hash_table_unref(b->printer_snapshot);
+    b->printer_snapshot = NULL;
+}
+
+void revalidate_printer_snapshot(BackendObj *b)
+{
+    if (b->printer_snapshot == NULL)
+        return;
+
+    logdebug("Revalidating printer snapshot\n");
+    b->snapshot_revalidating = TRUE;
+    if (!b->snapshot_enumerating)
+        start_snapshot_enumeration(b);
+}
+
 /** Don't free the returned value; it is owned by BackendObj */
 char *get_default_printer(BackendObj *b)
 {
@@ -94,14 +373,48 @@ void connect_to_dbus(BackendObj *b, char *obj_path)
     if (error)
     {
         logerror("Error connecting CUPS Backend to D-Bus.\n");
+        g_clear_error(&error);
+    }
+
+    g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(b->extensions),
+                                     b->dbus_connection,
+                                     obj_path,
+                                     &error);
+    if (error)
+    {
+        logerror("Error exporting the CUPS backend extensions: %s\n", error->message);
+        g_error_free(error);
     }
 }
 
 void add_frontend(BackendObj *b, const char *dialog_name)
 {
-    Dialog *d = get_new_Dialog();
-    g_hash_table_insert(b->dialogs, g_strdup(dialog_name), d);
-    b->num_frontends++;
+    Dialog *d = find_dialog(b, dialog_name);
+
+    /** A dialog asking for the list again keeps its filters, keep-alive
+     * and prefetches; only its printers are listed afresh **/
+    if (d)
+    {
+        if (d->listing)
+        {
+            g_atomic_int_set(&d->listing->cancel, 1);
+            unref_StreamListing(d->listing);
+            d->listing = NULL;
+        }
+        g_hash_table_remove_all(d->printers);
+    }
+    else
+    {
+        g_hash_table_insert(b->dialogs, g_strdup(dialog_name), get_new_Dialog());
+        b->num_frontends++;
+    }
+
+    if (b->linger_source)
+    {
+        logdebug("Dialog %s connected, no longer lingering\n", dialog_name);
+        g_source_remove(b->linger_source);
+        b->linger_source = 0;
+    }
 }
 
 void remove_frontend(BackendObj *b, const char *dialog_name)
@@ -128,17 +441,57 @@ Dialog *find_dialog(BackendObj *b, const char *dialog_name)
 int *get_dialog_cancel(BackendObj *b, const char *dialog_name)
 {
     Dialog *d = (Dialog *)(g_hash_table_lookup(b->dialogs, dialog_name));
-    return (d ? &d->cancel : NULL);
+    return ((d && d->listing) ? &d->listing->cancel : NULL);
 }
 void set_dialog_cancel(BackendObj *b, const char *dialog_name)
 {
     int *x = get_dialog_cancel(b, dialog_name);
-    if (x) *x = 1;
+    if (x) g_atomic_int_set(x, 1);
 }
 void reset_dialog_cancel(BackendObj *b, const char *dialog_name)
 {
     int *x = get_dialog_cancel(b, dialog_name);
-    if (x) *x = 0;
+    if (x) g_atomic_int_set(x, 0);
+}
+StreamListing *ref_StreamListing(StreamListing *listing)
+{
+    g_atomic_int_inc(&listing->ref_count);
+    return listing;
+}
+void unref_StreamListing(StreamListing *listing)
+{
+    if (listing == NULL || !g_atomic_int_dec_and_test(&listing->ref_count))
+        return;
+    g_free(listing->dialog_name);
+    g_free(listing);
+}
+StreamListing *start_dialog_listing(BackendObj *b, const char *dialog_name)
+{
+    Dialog *d = find_dialog(b, dialog_name);
+    if (d == NULL)
+        return NULL;
+
+    if (d->listing)
+    {
+        g_atomic_int_set(&d->listing->cancel, 1);
+        unref_StreamListing(d->listing);
+    }
+
+    d->listing = g_new0(StreamListing, 1);
+    d->listing->ref_count = 1;
+    d->listing->cancel = 0;
+    d->listing->dialog_name = g_strdup(dialog_name);
+    d->listing->generation = b->snapshot_generation;
+    return ref_StreamListing(d->listing);
+}
+gboolean dialog_listing_active(BackendObj *b, StreamListing *listing)
+{
+    Dialog *d;
+
+    if (g_atomic_int_get(&listing->cancel))
+        return FALSE;
+    d = find_dialog(b, listing->dialog_name);
+    return (d != NULL && d->listing == listing);
 }
 void set_hide_remote_printers(BackendObj *b, const char *dialog_name)
 {
@@ -407,32 +760,25 @@ void remove_printer_from_dialog(BackendObj *b, const char *dialog_name, const ch
     g_hash_table_remove(d->printers, printer_name);
 }
 
-void send_printer_added_signal(BackendObj *b, const char *dialog_name, cups_dest_t *dest)
+void send_printer_added_signal(BackendObj *b, const char *dialog_name, PrinterEntry *e)
 {
 
-    if (dest == NULL)
+    if (e == NULL)
     {
         logerror("Failed to send printer added signal.\n");
         return;
     }
-    char *printer_name = get_printer_name_for_cups_dest(dest);
-    GVariant *gv = g_variant_new(CPDB_PRINTER_ADDED_ARGS,
-                                 printer_name,                                   //id
-                                 printer_name,                                   //name
-                                 cups_retrieve_string(dest, "printer-info"),     //info
-                                 cups_retrieve_string(dest, "printer-location"), //location
-                                 cups_retrieve_string(dest, "printer-make-and-model"),
-                                 cups_is_accepting_jobs(dest),
-                                 cups_printer_state(dest),
-                                 "CUPS");
 
+    /** The record is shared by all the dialogs, so it is only referenced
+     * by the signal, never consumed
+     */
     GError *error = NULL;
     g_dbus_connection_emit_signal(b->dbus_connection,
                                   dialog_name,
                                   b->obj_path,
                                   "org.openprinting.PrintBackend",
                                   CPDB_SIGNAL_PRINTER_ADDED,
-                                  gv,
+                                  get_printer_entry_record(e),
                                   &error);
     g_assert_no_error(error);
 }
@@ -497,16 +843,16 @@ void notify_added_printers(BackendObj *b, const char *dialog_name, GHashTable *n
     logdebug("Notifying added printers.\n");
     gpointer printer_name;
     gpointer value;
-    cups_dest_t *dest = NULL;
+    PrinterEntry *e = NULL;
     g_hash_table_iter_init(&iter, new_table);
     while (g_hash_table_iter_next(&iter, &printer_name, &value))
     {
         if (!g_hash_table_contains(prev, (gchar *)printer_name))
         {
             g_message("Printer %s added\n", (char *)printer_name);
-            dest = (cups_dest_t *)value;
-            send_printer_added_signal(b, dialog_name, dest);
-            add_printer_to_dialog(b, dialog_name, dest);
+            e = (PrinterEntry *)value;
+            send_printer_added_signal(b, dialog_name, e);
+            add_printer_to_dialog(b, dialog_name, e->dest);
         }
     }
 }
@@ -514,774 +860,1922 @@ void notify_added_printers(BackendObj *b, const char *dialog_name, GHashTable *n
 gboolean get_hide_remote(BackendObj *b, const char *dialog_name)
 {
     Dialog *d = (Dialog *)g_hash_table_lookup(b->dialogs, dialog_name);
-    return d->hide_remote;
+    return (d ? d->hide_remote : FALSE);
 }
 gboolean get_hide_temp(BackendObj *b, const char *dialog_name)
 {
     Dialog *d = (Dialog *)g_hash_table_lookup(b->dialogs, dialog_name);
-    return d->hide_temp;
+    return (d ? d->hide_temp : FALSE);
 }
-void refresh_printer_list(BackendObj *b, const char *dialog_name)
+/** Bring the dialog's printer list in line with the snapshot and its filters **/
+static void sync_dialog_with_snapshot(BackendObj *b, const char *dialog_name, GHashTable *snapshot)
 {
+    Dialog *d = find_dialog(b, dialog_name);
     GHashTable *new_printers;
-    new_printers = cups_get_printers(get_hide_temp(b, dialog_name), get_hide_remote(b, dialog_name));
+    GHashTableIter iter;
+    gpointer key, value;
+
+    /** The dialog may have gone away while the snapshot was enumerated **/
+    if (d == NULL)
+        return;
+
+    new_printers = g_hash_table_new(g_str_hash, g_str_equal);
+    g_hash_table_iter_init(&iter, snapshot);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        PrinterEntry *e = value;
+        if (printer_entry_visible(e, d->hide_temp, d->hide_remote))
+            g_hash_table_insert(new_printers, key, e);
+    }
+
     notify_removed_printers(b, dialog_name, new_printers);
     notify_added_printers(b, dialog_name, new_printers);
+    g_hash_table_destroy(new_printers);
 }
-GHashTable *get_dialog_printers(BackendObj *b, const char *dialog_name)
+static void refresh_printer_list_cb(BackendObj *b, GHashTable *snapshot, gpointer user_data)
 {
-    Dialog *d = (Dialog *)g_hash_table_lookup(b->dialogs, dialog_name);
-    if (d == NULL)
-    {
-        logerror("Invalid dialog name.\n");
-        return NULL;
-    }
-    return d->printers;
+    char *dialog_name = user_data;
+    sync_dialog_with_snapshot(b, dialog_name, snapshot);
+    g_free(dialog_name);
 }
-PrinterCUPS *get_printer_by_name(BackendObj *b, const char *dialog_name, const char *printer_name)
+void refresh_printer_list(BackendObj *b, const char *dialog_name)
 {
-    GHashTable *printers = get_dialog_printers(b, dialog_name);
-    g_assert_nonnull(printers);
-    PrinterCUPS *p = (g_hash_table_lookup(printers, printer_name));
-    if (p == NULL)
-    {
-        logerror("Printer '%s' does not exist for the dialog %s.\n", printer_name, dialog_name);
-        return NULL;
-    }
-    return p;
+    request_printer_snapshot(b, refresh_printer_list_cb, g_strdup(dialog_name));
 }
-cups_dest_t *get_dest_by_name(BackendObj *b, const char *dialog_name, const char *printer_name)
+static void refresh_all_printer_lists_cb(BackendObj *b, GHashTable *snapshot, gpointer user_data)
 {
-    GHashTable *printers = get_dialog_printers(b, dialog_name);
-    g_assert_nonnull(printers);
-    PrinterCUPS *p = (g_hash_table_lookup(printers, printer_name));
-    if (p == NULL)
-    {
-        logerror("Printer '%s' does not exist for the dialog %s.\n", printer_name, dialog_name);
-	return NULL;
-    }
-    return p->dest;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *dialog_names, *l;
+
+    /** Copy the names, signalling may not touch b->dialogs but be safe **/
+    dialog_names = NULL;
+    g_hash_table_iter_init(&iter, b->dialogs);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        dialog_names = g_list_prepend(dialog_names, g_strdup(key));
+
+    for (l = dialog_names; l != NULL; l = l->next)
+        sync_dialog_with_snapshot(b, l->data, snapshot);
+    g_list_free_full(dialog_names, g_free);
 }
-/***************************PrinterObj********************************/
-PrinterCUPS *get_new_PrinterCUPS(const cups_dest_t *dest)
+void refresh_all_printer_lists(BackendObj *b)
 {
-    PrinterCUPS *p = (PrinterCUPS *)(malloc(sizeof(PrinterCUPS)));
+    request_printer_snapshot(b, refresh_all_printer_lists_cb, NULL);
+}
+void add_streamed_printer(BackendObj *b, StreamListing *listing,
+                          const char *printer_name, PrinterEntry *e)
+{
+    Dialog *d;
 
-    /** Make a copy of dest, because there are no guarantees 
-     * whether dest will always exist or if it will be freed**/
-    cups_dest_t *dest_copy = NULL;
-    cupsCopyDest((cups_dest_t *)dest, 0, &dest_copy);
-    if (dest_copy == NULL)
+    if (!dialog_listing_active(b, listing))
+        return;
+
+    d = find_dialog(b, listing->dialog_name);
+    if (!printer_entry_visible(e, d->hide_temp, d->hide_remote) ||
+        g_hash_table_contains(d->printers, printer_name))
+        return;
+
+    add_printer_to_dialog(b, listing->dialog_name, e->dest);
+    send_printer_added_signal(b, listing->dialog_name, e);
+    g_message("     Sent notification for printer %s\n", printer_name);
+}
+void install_streamed_snapshot(BackendObj *b, StreamListing *listing, GHashTable *printers)
+{
+    Dialog *d = find_dialog(b, listing->dialog_name);
+
+    if (d && d->listing == listing)
     {
-        logerror("Error creating PrinterCUPS");
-        return NULL;
+        d->listing = NULL;
+        unref_StreamListing(listing);
     }
-    p->dest = dest_copy;
-    p->name = get_printer_name_for_cups_dest(dest_copy);
-    p->http = NULL;
-    p->dinfo = NULL;
-    p->stream_socket_path = NULL;
 
-    return p;
+    /** A cancelled listing may have stopped early, and one which was
+     * overtaken by a printer change may be out of date **/
+    if (g_atomic_int_get(&listing->cancel) ||
+        listing->generation != b->snapshot_generation ||
+        b->printer_snapshot != NULL)
+        return;
+
+    logdebug("Using the streamed listing for %s as printer snapshot\n", listing->dialog_name);
+    b->printer_snapshot = g_hash_table_ref(printers);
+    schedule_backend_cache_save(b);
 }
 
-void free_PrinterCUPS(PrinterCUPS *p)
+/** Whether the printer name is the CUPS queue or one of its instances **/
+static gboolean printer_name_is_queue(const char *printer_name, const char *queue_name)
 {
-    logdebug("Freeing printerCUPS \n");
-    cupsFreeDests(1, p->dest);
-    g_free(p->name);
-    if (p->dinfo)
+    size_t len = strlen(queue_name);
+    return (strncmp(printer_name, queue_name, len) == 0 &&
+            (printer_name[len] == '\0' || printer_name[len] == '/'));
+}
+
+/**
+ * Bring the printer into line with every dialog's filters: add it where it
+ * should be shown but is not, remove it where it is shown but should not be.
+ * e == NULL removes the printer everywhere.
+ */
+static void sync_printer_with_dialogs(BackendObj *b, const char *printer_name, PrinterEntry *e)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init(&iter, b->dialogs);
+    while (g_hash_table_iter_next(&iter, &key, &value))
     {
-        cupsFreeDestInfo(p->dinfo);
+        const char *dialog_name = key;
+        Dialog *d = value;
+        gboolean visible = (e != NULL &&
+                            printer_entry_visible(e, d->hide_temp, d->hide_remote));
+
+        if (visible && !g_hash_table_contains(d->printers, printer_name))
+        {
+            g_message("Printer %s added\n", printer_name);
+            send_printer_added_signal(b, dialog_name, e);
+            add_printer_to_dialog(b, dialog_name, e->dest);
+        }
+        else if (!visible && g_hash_table_contains(d->printers, printer_name))
+        {
+            g_message("Printer %s removed\n", printer_name);
+            send_printer_removed_signal(b, dialog_name, printer_name);
+            remove_printer_from_dialog(b, dialog_name, printer_name);
+        }
     }
 }
 
-gboolean ensure_printer_connection(PrinterCUPS *p)
+/** A CUPS queue to look up again, with the names of its instances known so far **/
+typedef struct _PrinterLookup
 {
-    if (p->http)
-        return TRUE;
+    char *queue_name;
+    GPtrArray *instances;
+} PrinterLookup;
 
-    int temp = FALSE;
-    if (cups_is_temporary(p->dest)) temp = TRUE;
+static void free_PrinterLookup(PrinterLookup *lookup)
+{
+    g_free(lookup->queue_name);
+    g_ptr_array_unref(lookup->instances);
+    g_free(lookup);
+}
 
-    p->http = cupsConnectDest(p->dest, CUPS_DEST_FLAGS_NONE, 300, NULL, NULL, 0, NULL, NULL);
-    if (p->http == NULL)
-        return FALSE;
+/* Runs on a worker thread, must not touch the BackendObj */
+static void lookup_printer_thread(GTask *task,
+                                  gpointer source_object,
+                                  gpointer task_data,
+                                  GCancellable *cancellable)
+{
+    PrinterLookup *lookup = task_data;
+    GHashTable *entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                (GDestroyNotify)free_string,
+                                                (GDestroyNotify)unref_PrinterEntry);
+    GHashTable *stamps;
+    cups_dest_t *dest;
+    guint i;
+
+    dest = cupsGetNamedDest(CUPS_HTTP_DEFAULT, lookup->queue_name, NULL);
+    if (dest == NULL)
+    {
+        g_task_return_pointer(task, entries, (GDestroyNotify)g_hash_table_unref);
+        return;
+    }
+    add_printer_entry_to_ht(entries, 0, dest);
+    cupsFreeDests(1, dest);
 
-    // update dest after temporary CUPS queue has been created
-    if (temp)
+    /** The instances carry the queue's options under their own **/
+    for (i = 0; i < lookup->instances->len; i++)
     {
-        cups_dest_t *new_dest = cupsGetNamedDest(p->http, p->name, NULL);
-        cupsFreeDests(1, p->dest);
-        p->dest = new_dest;
+        const char *name = g_ptr_array_index(lookup->instances, i);
+        dest = cupsGetNamedDest(CUPS_HTTP_DEFAULT, lookup->queue_name,
+                                name + strlen(lookup->queue_name) + 1);
+        if (dest)
+        {
+            add_printer_entry_to_ht(entries, 0, dest);
+            cupsFreeDests(1, dest);
+        }
     }
 
-    p->dinfo = cupsCopyDestInfo(p->http, p->dest);
-    if (p->dinfo == NULL)
-        return FALSE;
+    stamps = fetch_config_stamps(lookup->queue_name);
+    set_config_stamps(entries, stamps);
+    g_hash_table_unref(stamps);
 
-    return TRUE;
+    g_task_return_pointer(task, entries, (GDestroyNotify)g_hash_table_unref);
 }
 
-int get_supported(PrinterCUPS *p, char ***supported_values, const char *option_name)
+/** Give the dialogs showing the printer a copy of its new destination;
+ * returns whether any dialog shows it **/
+static gboolean update_dialog_printer_dests(BackendObj *b, const char *printer_name, PrinterEntry *e)
 {
-    char **values;
-    ensure_printer_connection(p);
-    ipp_attribute_t *attrs =
-        cupsFindDestSupported(p->http, p->dest, p->dinfo, option_name);
-    int i, count = ippGetCount(attrs);
-    if (!count)
-    {
-        *supported_values = NULL;
-        return 0;
-    }
-
-    values = malloc(sizeof(char *) * count);
+    GHashTableIter iter;
+    gpointer value;
+    gboolean shown = FALSE;
 
-    for (i = 0; i < count; i++)
+    g_hash_table_iter_init(&iter, b->dialogs);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
     {
-        values[i] = extract_ipp_attribute(attrs, i, option_name);
+        Dialog *d = value;
+        PrinterCUPS *p = g_hash_table_lookup(d->printers, printer_name);
+        cups_dest_t *dest = NULL;
+
+        if (p == NULL || cupsCopyDest(e->dest, 0, &dest) == 0)
+            continue;
+        cupsFreeDests(1, p->dest);
+        p->dest = dest;
+        shown = TRUE;
     }
-    *supported_values = values;
-    return count;
+    return shown;
 }
 
-char *get_orientation_default(PrinterCUPS *p)
+static void printer_looked_up_cb(GObject *source_object,
+                                 GAsyncResult *res,
+                                 gpointer user_data)
 {
-    const char *def_value = cupsGetOption(CUPS_ORIENTATION, p->dest->num_options, p->dest->options);
-    if (def_value)
+    BackendObj *b = user_data;
+    PrinterLookup *lookup = g_task_get_task_data(G_TASK(res));
+    GHashTable *entries = g_task_propagate_pointer(G_TASK(res), NULL);
+    GHashTableIter iter;
+    gpointer key, value;
+    gboolean shown = FALSE;
+    guint i;
+
+    if (entries == NULL || g_hash_table_size(entries) == 0)
+    {
+        logdebug("Printer %s not found, removing it\n", lookup->queue_name);
+        remove_single_printer(b, lookup->queue_name);
+        if (entries)
+            g_hash_table_unref(entries);
+        return;
+    }
+
+    if (b->snapshot_enumerating && b->printer_snapshot == NULL)
+    {
+        /** The running enumeration may have missed this change **/
+        invalidate_printer_snapshot(b);
+    }
+
+    for (i = 0; i < lookup->instances->len; i++)
+    {
+        const char *name = g_ptr_array_index(lookup->instances, i);
+        if (g_hash_table_contains(entries, name))
+            continue;
+        sync_printer_with_dialogs(b, name, NULL);
+        if (b->printer_snapshot)
+            g_hash_table_remove(b->printer_snapshot, name);
+    }
+
+    g_hash_table_iter_init(&iter, entries);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        sync_printer_with_dialogs(b, key, value);
+        shown |= update_dialog_printer_dests(b, key, value);
+
+        /** The snapshot takes over the entry **/
+        if (b->printer_snapshot)
+            g_hash_table_replace(b->printer_snapshot, g_strdup(key), ref_PrinterEntry(value));
+    }
+    g_hash_table_unref(entries);
+
+    /** Options asked for while the lookup ran were built from the old
+     * queue defaults **/
+    if (shown)
+        invalidate_printer_capabilities(b, lookup->queue_name);
+}
+
+/** Add the names of the queue's instances in the table to the array, once **/
+static void collect_instance_names(GHashTable *printers, const char *queue_name,
+                                   GPtrArray *instances)
+{
+    GHashTableIter iter;
+    gpointer key;
+
+    g_hash_table_iter_init(&iter, printers);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+        if (printer_name_is_queue(key, queue_name) && strcmp(key, queue_name) != 0 &&
+            !g_ptr_array_find_with_equal_func(instances, key, g_str_equal, NULL))
+            g_ptr_array_add(instances, g_strdup(key));
+}
+
+void update_single_printer(BackendObj *b, const char *queue_name)
+{
+    GTask *task = g_task_new(NULL, NULL, printer_looked_up_cb, b);
+    PrinterLookup *lookup = g_new0(PrinterLookup, 1);
+    GHashTableIter iter;
+    gpointer value;
+
+    lookup->queue_name = g_strdup(queue_name);
+    lookup->instances = g_ptr_array_new_with_free_func(g_free);
+    if (b->printer_snapshot)
+        collect_instance_names(b->printer_snapshot, queue_name, lookup->instances);
+    g_hash_table_iter_init(&iter, b->dialogs);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        collect_instance_names(((Dialog *)value)->printers, queue_name, lookup->instances);
+
+    g_task_set_task_data(task, lookup, (GDestroyNotify)free_PrinterLookup);
+    g_task_run_in_thread(task, lookup_printer_thread);
+    g_object_unref(task);
+}
+
+void remove_single_printer(BackendObj *b, const char *queue_name)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *names = NULL, *l;
+
+    if (b->snapshot_enumerating && b->printer_snapshot == NULL)
+        invalidate_printer_snapshot(b);
+
+    /** Collect the names first, the tables are modified on the way **/
+    if (b->printer_snapshot)
+    {
+        g_hash_table_iter_init(&iter, b->printer_snapshot);
+        while (g_hash_table_iter_next(&iter, &key, &value))
+        {
+            if (printer_name_is_queue(key, queue_name))
+            {
+                names = g_list_prepend(names, g_strdup(key));
+                g_hash_table_iter_remove(&iter);
+            }
+        }
+    }
+    else
+    {
+        names = g_list_prepend(names, g_strdup(queue_name));
+    }
+
+    g_hash_table_iter_init(&iter, b->dialogs);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        Dialog *d = value;
+        GHashTableIter piter;
+        gpointer pkey;
+
+        g_hash_table_iter_init(&piter, d->printers);
+        while (g_hash_table_iter_next(&piter, &pkey, NULL))
+        {
+            if (printer_name_is_queue(pkey, queue_name) &&
+                !g_list_find_custom(names, pkey, (GCompareFunc)strcmp))
+                names = g_list_prepend(names, g_strdup(pkey));
+        }
+    }
+
+    for (l = names; l != NULL; l = l->next)
+        sync_printer_with_dialogs(b, l->data, NULL);
+    g_list_free_full(names, g_free);
+}
+
+static void set_dest_state(cups_dest_t *dest, guint printer_state, gboolean printer_is_accepting_jobs)
+{
+    char state[16];
+    snprintf(state, sizeof(state), "%u", printer_state);
+    dest->num_options = cupsAddOption("printer-state", state,
+                                      dest->num_options, &dest->options);
+    dest->num_options = cupsAddOption("printer-is-accepting-jobs",
+                                      printer_is_accepting_jobs ? "true" : "false",
+                                      dest->num_options, &dest->options);
+}
+
+void update_printer_state(BackendObj *b, const char *queue_name,
+                          guint printer_state, gboolean printer_is_accepting_jobs)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (b->printer_snapshot)
+    {
+        g_hash_table_iter_init(&iter, b->printer_snapshot);
+        while (g_hash_table_iter_next(&iter, &key, &value))
+        {
+            PrinterEntry *e = value;
+            if (!printer_name_is_queue(key, queue_name))
+                continue;
+
+            set_dest_state(e->dest, printer_state, printer_is_accepting_jobs);
+            if (e->record)
+            {
+                g_variant_unref(e->record);
+                e->record = NULL;
+            }
+        }
+    }
+
+    g_hash_table_iter_init(&iter, b->dialogs);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        const char *dialog_name = key;
+        Dialog *d = value;
+        GHashTableIter piter;
+        gpointer pkey, pvalue;
+
+        g_hash_table_iter_init(&piter, d->printers);
+        while (g_hash_table_iter_next(&piter, &pkey, &pvalue))
+        {
+            PrinterCUPS *p = pvalue;
+            if (!printer_name_is_queue(pkey, queue_name))
+                continue;
+
+            set_dest_state(p->dest, printer_state, printer_is_accepting_jobs);
+            send_printer_state_changed_signal(b, dialog_name, pkey,
+                                              cups_printer_state(p->dest),
+                                              printer_is_accepting_jobs);
+        }
+    }
+}
+
+void reclassify_printers_on_host(BackendObj *b, const char *host)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *names = NULL, *l;
+    char *pending_host;
+
+    if (b->printer_snapshot == NULL)
+        return;
+
+    g_hash_table_iter_init(&iter, b->printer_snapshot);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        PrinterEntry *e = value;
+        if (e->pending_host == NULL || g_ascii_strcasecmp(e->pending_host, host) != 0)
+            continue;
+
+        pending_host = e->pending_host;
+        e->pending_host = classify_pending_host(pending_host, &e->is_remote);
+        free(pending_host);
+        logdebug("Printer %s is %s\n", (char *)key, e->is_remote ? "remote" : "local");
+        names = g_list_prepend(names, g_strdup(key));
+    }
+
+    for (l = names; l != NULL; l = l->next)
+        sync_printer_with_dialogs(b, l->data,
+                                  g_hash_table_lookup(b->printer_snapshot, l->data));
+    g_list_free_full(names, g_free);
+}
+
+GHashTable *get_dialog_printers(BackendObj *b, const char *dialog_name)
+{
+    Dialog *d = (Dialog *)g_hash_table_lookup(b->dialogs, dialog_name);
+    if (d == NULL)
+    {
+        logerror("Invalid dialog name.\n");
+        return NULL;
+    }
+    return d->printers;
+}
+PrinterCUPS *get_printer_by_name(BackendObj *b, const char *dialog_name, const char *printer_name)
+{
+    GHashTable *printers = get_dialog_printers(b, dialog_name);
+    /** The dialog may have gone while a reply waited for a prefetch **/
+    if (printers == NULL)
+        return NULL;
+    PrinterCUPS *p = (g_hash_table_lookup(printers, printer_name));
+    if (p == NULL)
+    {
+        logerror("Printer '%s' does not exist for the dialog %s.\n", printer_name, dialog_name);
+        return NULL;
+    }
+    return p;
+}
+cups_dest_t *get_dest_by_name(BackendObj *b, const char *dialog_name, const char *printer_name)
+{
+    GHashTable *printers = get_dialog_printers(b, dialog_name);
+    g_assert_nonnull(printers);
+    PrinterCUPS *p = (g_hash_table_lookup(printers, printer_name));
+    if (p == NULL)
+    {
+        logerror("Printer '%s' does not exist for the dialog %s.\n", printer_name, dialog_name);
+	return NULL;
+    }
+    return p->dest;
+}
+/***************************PrinterObj********************************/
+PrinterCUPS *get_new_PrinterCUPS(const cups_dest_t *dest)
+{
+    PrinterCUPS *p = (PrinterCUPS *)(malloc(sizeof(PrinterCUPS)));
+
+    /** Make a copy of dest, because there are no guarantees 
+     * whether dest will always exist or if it will be freed**/
+    cups_dest_t *dest_copy = NULL;
+    cupsCopyDest((cups_dest_t *)dest, 0, &dest_copy);
+    if (dest_copy == NULL)
+    {
+        logerror("Error creating PrinterCUPS");
+        return NULL;
+    }
+    p->dest = dest_copy;
+    p->name = get_printer_name_for_cups_dest(dest_copy);
+    p->http = NULL;
+    p->dinfo = NULL;
+    p->attrs = NULL;
+    p->stream_socket_path = NULL;
+
+    return p;
+}
+
+void free_PrinterCUPS(PrinterCUPS *p)
+{
+    logdebug("Freeing printerCUPS \n");
+    cupsFreeDests(1, p->dest);
+    g_free(p->name);
+    if (p->dinfo)
+    {
+        cupsFreeDestInfo(p->dinfo);
+    }
+    ippDelete(p->attrs);
+}
+
+PrinterEntry *get_new_PrinterEntry(const cups_dest_t *dest)
+{
+    PrinterEntry *e = g_new0(PrinterEntry, 1);
+
+    cupsCopyDest((cups_dest_t *)dest, 0, &e->dest);
+    if (e->dest == NULL)
+    {
+        logerror("Error creating PrinterEntry");
+        g_free(e);
+        return NULL;
+    }
+    e->ref_count = 1;
+    e->name = get_printer_name_for_cups_dest(e->dest);
+    e->record = NULL;
+    e->is_temporary = cups_is_temporary(e->dest);
+    e->pending_host = cups_classify_remote(e->dest, &e->is_remote);
+
+    return e;
+}
+
+PrinterEntry *ref_PrinterEntry(PrinterEntry *e)
+{
+    g_atomic_int_inc(&e->ref_count);
+    return e;
+}
+
+void unref_PrinterEntry(PrinterEntry *e)
+{
+    if (e == NULL || !g_atomic_int_dec_and_test(&e->ref_count))
+        return;
+    if (e->record)
+        g_variant_unref(e->record);
+    g_free(e->name);
+    free(e->pending_host);
+    g_free(e->config_stamp);
+    cupsFreeDests(1, e->dest);
+    g_free(e);
+}
+
+GVariant *get_printer_entry_record(PrinterEntry *e)
+{
+    char *info, *location, *make;
+
+    if (e->record)
+        return e->record;
+
+    info = cups_retrieve_string(e->dest, "printer-info");
+    location = cups_retrieve_string(e->dest, "printer-location");
+    make = cups_retrieve_string(e->dest, "printer-make-and-model");
+    e->record = g_variant_ref_sink(g_variant_new(CPDB_PRINTER_ARGS,
+                                                 e->name,       //id
+                                                 e->name,       //name
+                                                 info,
+                                                 location,
+                                                 make,
+                                                 cups_is_accepting_jobs(e->dest),
+                                                 cups_printer_state(e->dest),
+                                                 BACKEND_NAME));
+    free(info);
+    free(location);
+    free(make);
+    return e->record;
+}
+
+gboolean printer_entry_visible(const PrinterEntry *e, gboolean hide_temp, gboolean hide_remote)
+{
+    if (hide_temp && e->is_temporary)
+        return FALSE;
+    if (hide_remote && e->is_remote)
+        return FALSE;
+    return TRUE;
+}
+
+gboolean ensure_printer_connection(PrinterCUPS *p)
+{
+    if (p->http)
+        return TRUE;
+
+    int temp = FALSE;
+    if (cups_is_temporary(p->dest)) temp = TRUE;
+
+    p->http = cupsConnectDest(p->dest, CUPS_DEST_FLAGS_NONE, 300, NULL, NULL, 0, NULL, NULL);
+    if (p->http == NULL)
+        return FALSE;
+
+    // update dest after temporary CUPS queue has been created
+    if (temp)
+    {
+        cups_dest_t *new_dest = cupsGetNamedDest(p->http, p->name, NULL);
+        cupsFreeDests(1, p->dest);
+        p->dest = new_dest;
+    }
+
+    return TRUE;
+}
+
+gboolean ensure_printer_dinfo(PrinterCUPS *p)
+{
+    if (p->dinfo)
+        return TRUE;
+    if (!ensure_printer_connection(p))
+        return FALSE;
+
+    p->dinfo = cupsCopyDestInfo(p->http, p->dest);
+    return (p->dinfo != NULL);
+}
+
+static ipp_t *request_printer_attributes(PrinterCUPS *p, int num_attributes,
+                                         const char *const *requested_attributes)
+{
+    ipp_t *request, *response;
+    const char *uri;
+
+    if (!ensure_printer_connection(p))
+        return NULL;
+
+    request = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
+    uri = cupsGetOption("printer-uri-supported",
+                        p->dest->num_options,
+                        p->dest->options);
+    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                 "printer-uri", NULL, uri);
+    ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+                  "requested-attributes", num_attributes,
+                  NULL, requested_attributes);
+
+    response = cupsDoRequest(p->http, request, "/");
+    if (cupsLastError() >= IPP_STATUS_ERROR_BAD_REQUEST)
+    {
+        /* request failed */
+        logerror("Request failed: %s\n", cupsLastErrorString());
+        ippDelete(response);
+        return NULL;
+    }
+    return response;
+}
+
+ipp_t *get_printer_attributes(PrinterCUPS *p)
+{
+    /** Everything the options, media and translations are built from;
+     * "all" does not include media-col-database **/
+    static const char *const requested_attributes[] = {"all",
+                                                       "media-col-database",
+                                                       "printer-strings-uri",
+                                                       "printer-config-change-time"};
+
+    if (p->attrs)
+        return p->attrs;
+
+    p->attrs = request_printer_attributes(p, G_N_ELEMENTS(requested_attributes),
+                                          requested_attributes);
+    if (p->attrs)
+        logdebug("Fetched the attributes of %s\n", p->name);
+    return p->attrs;
+}
+
+void reset_printer_attributes(PrinterCUPS *p)
+{
+    ippDelete(p->attrs);
+    p->attrs = NULL;
+    if (p->dinfo)
+    {
+        cupsFreeDestInfo(p->dinfo);
+        p->dinfo = NULL;
+    }
+}
+
+static ipp_attribute_t *find_printer_attribute(PrinterCUPS *p, const char *option_name,
+                                               const char *suffix)
+{
+    char name[IPP_MAX_NAME];
+    ipp_t *attrs = get_printer_attributes(p);
+
+    if (attrs == NULL)
+        return NULL;
+    snprintf(name, sizeof(name), "%s-%s", option_name, suffix);
+    return ippFindAttribute(attrs, name, IPP_TAG_ZERO);
+}
+
+ipp_attribute_t *find_printer_supported(PrinterCUPS *p, const char *option_name)
+{
+    return find_printer_attribute(p, option_name, "supported");
+}
+
+ipp_attribute_t *find_printer_default(PrinterCUPS *p, const char *option_name)
+{
+    return find_printer_attribute(p, option_name, "default");
+}
+
+int get_supported(PrinterCUPS *p, char ***supported_values, const char *option_name)
+{
+    char **values;
+    ipp_attribute_t *attrs = find_printer_supported(p, option_name);
+    int i, count = ippGetCount(attrs);
+    if (!count)
+    {
+        *supported_values = NULL;
+        return 0;
+    }
+
+    values = malloc(sizeof(char *) * count);
+
+    for (i = 0; i < count; i++)
+    {
+        values[i] = extract_ipp_attribute(attrs, i, option_name);
+    }
+    *supported_values = values;
+    return count;
+}
+
+char *get_orientation_default(PrinterCUPS *p)
+{
+    const char *def_value = cupsGetOption(CUPS_ORIENTATION, p->dest->num_options, p->dest->options);
+    if (def_value)
     {
         switch (def_value[0])
         {
-        case '0':
-            return g_strdup("automatic-rotation");
-        default:
-            return g_strdup(ippEnumString(CUPS_ORIENTATION, atoi(def_value)));
+        case '0':
+            return g_strdup("automatic-rotation");
+        default:
+            return g_strdup(ippEnumString(CUPS_ORIENTATION, atoi(def_value)));
+        }
+    }
+    ipp_attribute_t *attr = NULL;
+
+    attr = find_printer_default(p, CUPS_ORIENTATION);
+    if (!attr)
+        return g_strdup("NA");
+
+    const char *str = ippEnumString(CUPS_ORIENTATION, ippGetInteger(attr, 0));
+    if (strcmp("0", str) == 0)
+        str = "automatic-rotation";
+    return g_strdup(str);
+}
+
+int get_job_creation_attributes(PrinterCUPS *p, char ***values)
+{
+    return get_supported(p, values, "job-creation-attributes");
+}
+
+char *get_default(PrinterCUPS *p, char *option_name)
+{
+    /** first take care of special cases**/
+    if (strcmp(option_name, CUPS_ORIENTATION) == 0)
+        return get_orientation_default(p);
+
+    /** Generic cases next **/
+    ipp_attribute_t *def_attr = find_printer_default(p, option_name);
+    const char *def_value = cupsGetOption(option_name, p->dest->num_options, p->dest->options);
+
+    /** First check the option is already there in p->dest->options **/
+    if (def_value)
+    {
+        if (def_attr && (ippGetValueTag(def_attr) == IPP_TAG_ENUM))
+            return g_strdup(ippEnumString(option_name, atoi(def_value)));
+
+        return g_strdup(def_value);
+    }
+    if (def_attr)
+    {
+        return extract_ipp_attribute(def_attr, 0, option_name);
+    }
+    return g_strdup("NA");
+}
+/**************Option************************************/
+static GVariant *get_fixed_option_values(int fixed_index);
+
+Option *get_NA_option()
+{
+    Option *o = (Option *)malloc(sizeof(Option));
+    o->fixed_index = -1;
+    o->option_name = "NA";
+    o->default_value = "NA";
+    o->num_supported = 0;
+    o->supported_values = cpdbNewCStringArray(1);
+    o->supported_values[0] = "bub";
+
+    return o;
+}
+void print_option(const Option *opt)
+{
+    g_message("%s", opt->option_name);
+    int i;
+    for (i = 0; i < opt->num_supported; i++)
+    {
+        logdebug(" %s\n", opt->supported_values[i]);
+    }
+    logdebug("****DEFAULT: %s\n", opt->default_value);
+}
+PrinterCapabilities *ref_PrinterCapabilities(PrinterCapabilities *caps)
+{
+    g_atomic_int_inc(&caps->ref_count);
+    return caps;
+}
+void unref_PrinterCapabilities(PrinterCapabilities *caps)
+{
+    if (caps == NULL || !g_atomic_int_dec_and_test(&caps->ref_count))
+        return;
+    if (caps->model)
+        unref_PrinterCapabilities(caps->model);
+    g_free(caps->model_key);
+    g_free(caps->config_stamp);
+    if (caps->reply)
+        g_variant_unref(caps->reply);
+    g_free(caps->etag);
+    if (caps->translations)
+        g_hash_table_destroy(caps->translations);
+    arena_free(caps->arena);
+    g_free(caps);
+}
+void unpack_option_array(GVariant *var, int num_options, Option **options)
+{
+    Option *opt = (Option *)(malloc(sizeof(Option) * num_options));
+    int i, j;
+    char *str;
+    GVariantIter *iter;
+    GVariantIter *array_iter;
+    char *name, *default_val;
+    int num_sup;
+    g_variant_get(var, "a(ssia(s))", &iter);
+    for (i = 0; i < num_options; i++)
+    {
+        //logdebug("i = %d\n", i);
+
+        g_variant_iter_loop(iter, "(ssia(s))", &name, &default_val,
+                            &num_sup, &array_iter);
+        opt[i].option_name = g_strdup(name);
+        opt[i].fixed_index = -1;
+        opt[i].default_value = g_strdup(default_val);
+        opt[i].num_supported = num_sup;
+        opt[i].supported_values = cpdbNewCStringArray(num_sup);
+        for (j = 0; j < num_sup; j++)
+        {
+            g_variant_iter_loop(array_iter, "(s)", &str);
+            opt[i].supported_values[j] = g_strdup(str); //mem
+        }
+        print_option(&opt[i]);
+    }
+
+    *options = opt;
+}
+GVariant *pack_option(const Option *opt)
+{
+    char *group_name = cpdbGetGroup(opt->option_name);
+    GVariant **t = g_new(GVariant *, 5);
+    t[0] = g_variant_new_string(opt->option_name);
+    t[1] = g_variant_new_string(group_name);
+    t[2] = g_variant_new_string(opt->default_value);
+    t[3] = g_variant_new_int32(opt->num_supported);
+    t[4] = (opt->fixed_index >= 0 ? get_fixed_option_values(opt->fixed_index)
+                                  : cpdbPackStringArray(opt->num_supported, opt->supported_values));
+    GVariant *tuple_variant = g_variant_new_tuple(t, 5);
+    g_free(t);
+    free(group_name);
+    return tuple_variant;
+}
+GVariant *pack_margins(const Media *media)
+{
+    /** int[4] is laid out exactly like (iiii), so the table is copied as is **/
+    return g_variant_new_fixed_array(G_VARIANT_TYPE("(iiii)"), media->margins,
+                                     media->num_margins, sizeof(int) * 4);
+}
+GVariant *pack_media(const Media *media)
+{
+	GVariant **t = g_new(GVariant *, 5);
+	t[0] = g_variant_new_string(media->name);
+	t[1] = g_variant_new_int32(media->width);
+	t[2] = g_variant_new_int32(media->length);
+	t[3] = g_variant_new_int32(media->num_margins);
+	t[4] = pack_margins(media);
+	GVariant *tuple_variant = g_variant_new_tuple(t, 5);
+	g_free(t);
+	return tuple_variant;
+}
+/**
+ * The options CUPS offers for every printer, whatever the printer reports.
+ * Only their defaults depend on the printer.
+ */
+typedef struct _FixedOption
+{
+    const char *name;
+    int num_supported;
+    const char *const *supported_values;
+    /** default if the printer has none, NULL for the first supported value **/
+    const char *fallback_default;
+} FixedOption;
+
+static const char *const off_on[] = {"off", "on"};
+static const char *const booklet_values[] = {"off", "on", "shuffle-only"};
+static const char *const job_sheets_values[] = {"none", "classified", "confidential", "form",
+                                                "secret", "standard", "topsecret", "unclassified"};
+static const char *const multiple_document_handling_values[] = {"separate-documents-uncollated-copies",
+                                                                 "separate-documents-collated-copies"};
+static const char *const number_up_values[] = {"1", "2", "4", "6", "9", "16"};
+static const char *const number_up_layout_values[] = {"lrtb", "lrbt", "rltb", "rlbt",
+                                                      "tblr", "tbrl", "btlr", "btrl"};
+static const char *const orientation_requested_values[] = {"3", "4", "5", "6"};
+static const char *const page_border_values[] = {"none", "single", "single-thick",
+                                                 "double", "double-thick"};
+static const char *const page_delivery_values[] = {"same-order", "reverse-order"};
+static const char *const page_set_values[] = {"all", "even", "odd"};
+static const char *const position_values[] = {"center", "top", "bottom", "left", "right",
+                                              "top-left", "top-right", "bottom-left", "bottom-right"};
+static const char *const print_scaling_values[] = {"auto", "auto-fit", "fill", "fit", "none"};
+
+#define FIXED_OPTION(name, values, fallback) {name, G_N_ELEMENTS(values), values, fallback}
+
+/** Sorted by name, for find_fixed_option() **/
+static const FixedOption fixed_options[] = {
+    {"billing-info", 0, NULL, ""},
+    FIXED_OPTION("booklet", booklet_values, NULL),
+    FIXED_OPTION("ipp-attribute-fidelity", off_on, NULL),
+    FIXED_OPTION("job-sheets", job_sheets_values, "none,none"),
+    FIXED_OPTION("mirror", off_on, NULL),
+    FIXED_OPTION("multiple-document-handling", multiple_document_handling_values, NULL),
+    FIXED_OPTION("number-up", number_up_values, NULL),
+    FIXED_OPTION("number-up-layout", number_up_layout_values, NULL),
+    FIXED_OPTION("orientation-requested", orientation_requested_values, NULL),
+    FIXED_OPTION("page-border", page_border_values, NULL),
+    FIXED_OPTION("page-delivery", page_delivery_values, NULL),
+    FIXED_OPTION("page-set", page_set_values, NULL),
+    FIXED_OPTION("position", position_values, NULL),
+    FIXED_OPTION("print-scaling", print_scaling_values, NULL),
+};
+
+static int compare_fixed_option(const void *name, const void *entry)
+{
+    return strcmp((const char *)name, ((const FixedOption *)entry)->name);
+}
+
+static const FixedOption *find_fixed_option(const char *option_name)
+{
+    return bsearch(option_name, fixed_options, G_N_ELEMENTS(fixed_options),
+                   sizeof(fixed_options[0]), compare_fixed_option);
+}
+
+/** Printer options which are replaced by the fixed ones or added with the media sizes **/
+static gboolean is_skipped_option(const char *option_name)
+{
+    return (find_fixed_option(option_name) != NULL ||
+            strcmp(option_name, "media") == 0 ||
+            strcmp(option_name, "media-col") == 0);
+}
+
+static char *get_fixed_option_default(PrinterCUPS *p, const FixedOption *fixed)
+{
+    char *def = get_default(p, (char *)fixed->name);
+    const char *mapped = NULL;
+
+    if (strcmp(def, "NA") == 0)
+        mapped = (fixed->fallback_default ? fixed->fallback_default : fixed->supported_values[0]);
+    else if (strcmp(fixed->name, "orientation-requested") == 0)
+    {
+        if (strcmp(def, "landscape") == 0)
+            mapped = fixed->supported_values[1];
+        else if (strcmp(def, "reverse-landscape") == 0)
+            mapped = fixed->supported_values[2];
+        /** Misspelt "reverse-potrait" before, which gave such queues
+         * portrait (index 0) as the default **/
+        else if (strcmp(def, "reverse-portrait") == 0)
+            mapped = fixed->supported_values[3];
+        else
+            mapped = fixed->supported_values[0];
+    }
+
+    if (mapped == NULL)
+        return def;
+    free(def);
+    return g_strdup(mapped);
+}
+
+/** The packed supported values of a fixed option, built once and shared **/
+static GVariant *get_fixed_option_values(int fixed_index)
+{
+    static gsize initialized = 0;
+    static GVariant *packed[G_N_ELEMENTS(fixed_options)];
+    guint i;
+
+    if (g_once_init_enter(&initialized))
+    {
+        for (i = 0; i < G_N_ELEMENTS(fixed_options); i++)
+        {
+            g_assert(i == 0 || strcmp(fixed_options[i - 1].name, fixed_options[i].name) < 0);
+            packed[i] = g_variant_ref_sink(cpdbPackStringArray(fixed_options[i].num_supported,
+                                                               (char **)fixed_options[i].supported_values));
+        }
+        g_once_init_leave(&initialized, 1);
+    }
+    return packed[fixed_index];
+}
+
+/** Fill in an option the printer reports, name already in the arena **/
+static void fill_printer_option(PrinterCUPS *p, Arena *arena, Option *opt, char *option_name)
+{
+    ipp_attribute_t *vals = find_printer_supported(p, option_name);
+    int j;
+
+    opt->option_name = option_name;
+    opt->fixed_index = -1;
+    opt->num_supported = (vals ? ippGetCount(vals) : 0);
+
+    /** Retreive all the supported values for that option **/
+    opt->supported_values = arena_alloc(arena, sizeof(char *) * (opt->num_supported + 1));
+    for (j = 0; j < opt->num_supported; j++)
+    {
+        opt->supported_values[j] = arena_take_string(arena, extract_ipp_attribute(vals, j, option_name));
+        if (opt->supported_values[j] == NULL)
+        {
+            opt->supported_values[j] = arena_strdup(arena, "NA");
+        }
+    }
+
+    /** Retrieve the default value for that option **/
+    opt->default_value = arena_take_string(arena, get_default(p, option_name));
+    if (opt->default_value == NULL)
+    {
+        opt->default_value = arena_strdup(arena, "NA");
+    }
+}
+
+static void fill_fixed_option(PrinterCUPS *p, Arena *arena, Option *opt, const FixedOption *fixed)
+{
+    opt->option_name = (char *)fixed->name;
+    opt->num_supported = fixed->num_supported;
+    opt->supported_values = (char **)fixed->supported_values;
+    opt->fixed_index = fixed - fixed_options;
+    opt->default_value = arena_take_string(arena, get_fixed_option_default(p, fixed));
+}
+
+/** CUPS reports print-quality as keywords, the dialogs expect the enum values **/
+static void correct_print_quality(Arena *arena, Option *opt)
+{
+    int j;
+
+    for (j = 0; j < opt->num_supported; j++)
+    {
+        if (strcasecmp(opt->supported_values[j], "draft") == 0)
+        {
+            opt->supported_values[j] = arena_strdup(arena, "3");
+            continue;
+        }
+        if (strcasecmp(opt->supported_values[j], "normal") == 0)
+        {
+            opt->supported_values[j] = arena_strdup(arena, "4");
+            continue;
+        }
+        if (strcasecmp(opt->supported_values[j], "high") == 0)
+        {
+            opt->supported_values[j] = arena_strdup(arena, "5");
+            continue;
+        }
+    }
+
+    if (strcasecmp(opt->default_value, "draft") == 0)
+        opt->default_value = arena_strdup(arena, "3");
+    else if (strcasecmp(opt->default_value, "normal") == 0)
+        opt->default_value = arena_strdup(arena, "4");
+    else if (strcasecmp(opt->default_value, "high") == 0)
+        opt->default_value = arena_strdup(arena, "5");
+}
+
+int get_all_options(PrinterCUPS *p, Arena *arena, Option **options)
+{
+    char **option_names;
+    int num_options = get_job_creation_attributes(p, &option_names); /** number of options to be returned**/
+
+    /** Addition options not present in "job-creation-attributes" **/
+    char *additional_options[] = {"media-source", "media-type"}; 
+    int sz = sizeof(additional_options) / sizeof(char *);
+
+    /** Add additional attributes to current option_names list **/
+    option_names = realloc(option_names, sizeof(char *) * (num_options+sz)); 
+    for (int i=0; i<sz; i++) 
+        option_names[num_options+i] = g_strdup(additional_options[i]);
+    num_options += sz;
+
+    int i, optsIndex = 0;                                            /**Looping variables **/
+
+    Option *opts = arena_alloc(arena, sizeof(Option) * (num_options + G_N_ELEMENTS(fixed_options))); /**Option array, which will be filled **/
+
+    for (i = 0; i < num_options; i++)
+    {
+        // Hardcode CUPS specific option
+        if (is_skipped_option(option_names[i]))
+        {
+            free(option_names[i]);
+            continue;
         }
+
+        fill_printer_option(p, arena, &opts[optsIndex], arena_take_string(arena, option_names[i]));
+        optsIndex++;
     }
-    ensure_printer_connection(p);
-    ipp_attribute_t *attr = NULL;
 
-    attr = cupsFindDestDefault(p->http, p->dest, p->dinfo, CUPS_ORIENTATION);
-    if (!attr)
-        return g_strdup("NA");
+    /** the names have been moved into opts or freed **/
+    free(option_names);
 
-    const char *str = ippEnumString(CUPS_ORIENTATION, ippGetInteger(attr, 0));
-    if (strcmp("0", str) == 0)
-        str = "automatic-rotation";
-    return g_strdup(str);
+    /* Add the options CUPS offers for every printer */
+    for (i = 0; i < G_N_ELEMENTS(fixed_options); i++)
+        fill_fixed_option(p, arena, &opts[optsIndex++], &fixed_options[i]);
+
+    /* Correct the print-quality option */
+    for (i = 0; i < optsIndex; i++)
+    {
+        if (strcmp(opts[i].option_name, "print-quality") == 0)
+        {
+            correct_print_quality(arena, &opts[i]);
+            break;
+        }
+    }
+
+    *options = opts;
+    return optsIndex;
 }
+/**
+ * PWG size names are looked up once per size and remembered for the
+ * lifetime of the backend; the same sizes turn up on every printer
+ */
+typedef struct _PwgSize
+{
+    char *name;
+    int width;
+    int length;
+} PwgSize;
 
-int get_job_creation_attributes(PrinterCUPS *p, char ***values)
+G_LOCK_DEFINE_STATIC(pwg_sizes);
+static GHashTable *pwg_sizes_by_dimensions;  /** [width<<32|length] --> PwgSize* **/
+static GHashTable *pwg_sizes_by_name;        /** [PWG name] --> PwgSize* **/
+
+static const PwgSize *lookup_pwg_size(int width, int length)
 {
-    return get_supported(p, values, "job-creation-attributes");
+    gint64 dimensions = ((gint64) width << 32) | (guint32) length;
+    gint64 *key;
+    PwgSize *size;
+    pwg_media_t *pwg_media;
+    char *name;
+
+    G_LOCK(pwg_sizes);
+    if (pwg_sizes_by_dimensions == NULL)
+    {
+        pwg_sizes_by_dimensions = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+        pwg_sizes_by_name = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+
+    size = g_hash_table_lookup(pwg_sizes_by_dimensions, &dimensions);
+    if (size == NULL && (pwg_media = pwgMediaForSize(width, length)) != NULL)
+    {
+        /** Sizes within the tolerance of a standard size share its name **/
+        name = g_strdup(pwg_media->pwg);
+        size = g_hash_table_lookup(pwg_sizes_by_name, name);
+        if (size == NULL)
+        {
+            size = g_new0(PwgSize, 1);
+            size->name = name;
+            if ((pwg_media = pwgMediaForPWG(name)) != NULL)
+            {
+                size->width = pwg_media->width;
+                size->length = pwg_media->length;
+            }
+            else
+            {
+                size->width = width;
+                size->length = length;
+            }
+            g_hash_table_insert(pwg_sizes_by_name, size->name, size);
+        }
+        else
+            g_free(name);
+
+        key = g_new(gint64, 1);
+        *key = dimensions;
+        g_hash_table_insert(pwg_sizes_by_dimensions, key, size);
+    }
+    G_UNLOCK(pwg_sizes);
+
+    return size;
 }
 
-char *get_default(PrinterCUPS *p, char *option_name)
+/** A media-col-database entry reduced to its size and margins **/
+typedef struct _MediaEntry
 {
-    /** first take care of special cases**/
-    if (strcmp(option_name, CUPS_ORIENTATION) == 0)
-        return get_orientation_default(p);
+    const PwgSize *size;
+    int margins[4];    /** left, right, top, bottom **/
+} MediaEntry;
 
-    /** Generic cases next **/
-    ensure_printer_connection(p);
-    ipp_attribute_t *def_attr = cupsFindDestDefault(p->http, p->dest, p->dinfo, option_name);
-    const char *def_value = cupsGetOption(option_name, p->dest->num_options, p->dest->options);
+static guint media_entry_hash(gconstpointer v)
+{
+    const MediaEntry *e = v;
+    guint hash = g_direct_hash(e->size);
+    for (int i = 0; i < 4; i++)
+        hash = hash * 31 + e->margins[i];
+    return hash;
+}
 
-    /** First check the option is already there in p->dest->options **/
-    if (def_value)
+static gboolean media_entry_equal(gconstpointer a, gconstpointer b)
+{
+    const MediaEntry *x = a, *y = b;
+    return x->size == y->size && memcmp(x->margins, y->margins, sizeof(x->margins)) == 0;
+}
+
+int get_all_media(PrinterCUPS *p, Arena *arena, Media **medias)
+{	
+	ipp_t *response = get_printer_attributes(p);
+	*medias = NULL;
+	if (response == NULL)
+		return 0;
+    
+    int media_num = 0;				/** Number of unqiue media sizes **/
+    Media *meds = NULL;				/** Array of unique media sizes **/
+
+    ipp_attribute_t *mdb; // media database
+    if ((mdb = ippFindAttribute(response, "media-col-database", IPP_TAG_BEGIN_COLLECTION)) != NULL)
     {
-        if (def_attr && (ippGetValueTag(def_attr) == IPP_TAG_ENUM))
-            return g_strdup(ippEnumString(option_name, atoi(def_value)));
+		int i, width, length;
+		ipp_t *tuple; 				/** Single media entry in media-col-database **/
+		ipp_t *media_size;			/** media-size collection in a media tuple **/ 
+		ipp_attribute_t *attr;		/** Temporary variable for ipp attributes in a single tuple **/
+		static const char *const margin_attrs[4] = {"media-left-margin", "media-right-margin",
+		                                            "media-top-margin", "media-bottom-margin"};
 
-        return g_strdup(def_value);
+		int count = ippGetCount(mdb);
+		int num_entries = 0;		/** Number of distinct (size, margins) entries **/
+		MediaEntry *entries = g_new(MediaEntry, count);
+		GHashTable *seen = g_hash_table_new(media_entry_hash, media_entry_equal);
+		GHashTable *sizes = g_hash_table_new(g_direct_hash, g_direct_equal);	/** [PwgSize*] --> index + 1 **/
+		int *num_margins = g_new0(int, count);	/** per media size, in order of appearance **/
+		int *cursor;
+		int (*margin_table)[4];
+
+		/** Collapse the source x type combinations, which mostly repeat
+		 * the same margins for a size, keeping the order of appearance **/
+		for (i = 0; i < count; i++)
+		{
+			MediaEntry *e = &entries[num_entries];
+
+			tuple = ippGetCollection(mdb, i);
+			attr = ippFindAttribute(tuple, "media-size", IPP_TAG_BEGIN_COLLECTION);
+			media_size = ippGetCollection(attr, 0);
+			attr = ippFindAttribute(media_size, "x-dimension", IPP_TAG_INTEGER);
+			width = ippGetInteger(attr, 0);
+			attr = ippFindAttribute(media_size, "y-dimension", IPP_TAG_INTEGER);
+			length = ippGetInteger(attr, 0);
+
+			if (width <= 0 || length <= 0)
+			  continue;
+			if ((e->size = lookup_pwg_size(width, length)) == NULL)
+			  continue;
+
+			for (int k = 0; k < 4; k++)
+			{
+				attr = ippFindAttribute(tuple, margin_attrs[k], IPP_TAG_INTEGER);
+				e->margins[k] = ippGetInteger(attr, 0);
+			}
+
+			if (g_hash_table_contains(seen, e))
+				continue;
+			g_hash_table_add(seen, e);
+
+			if (!g_hash_table_contains(sizes, e->size))
+				g_hash_table_insert(sizes, (gpointer) e->size, GINT_TO_POINTER(++media_num));
+			num_margins[GPOINTER_TO_INT(g_hash_table_lookup(sizes, e->size)) - 1]++;
+			num_entries++;
+		}
+
+		/** One contiguous margin table, each size owning a run of it **/
+		meds = arena_alloc(arena, sizeof(Media) * media_num);
+		margin_table = arena_alloc(arena, sizeof(int) * 4 * num_entries);
+		cursor = g_new0(int, media_num + 1);
+		for (i = 0; i < media_num; i++)
+		{
+			meds[i].margins = margin_table + cursor[i];
+			cursor[i + 1] = cursor[i] + num_margins[i];
+		}
+
+		for (i = 0; i < num_entries; i++)
+		{
+			MediaEntry *e = &entries[i];
+			Media *m = &meds[GPOINTER_TO_INT(g_hash_table_lookup(sizes, e->size)) - 1];
+
+			if (m->name == NULL)
+			{
+				m->name = arena_strdup(arena, e->size->name);
+				m->width = e->size->width;
+				m->length = e->size->length;
+			}
+			memcpy(m->margins[m->num_margins++], e->margins, sizeof(e->margins));
+		}
+
+		g_free(cursor);
+		g_free(num_margins);
+		g_hash_table_destroy(sizes);
+		g_hash_table_destroy(seen);
+		g_free(entries);
+	}
+	
+	*medias = meds;
+	return media_num;
+}
+/** The printer-config-change-time of the printer as of the snapshot, "" if unknown **/
+static const char *get_config_stamp(BackendObj *b, PrinterCUPS *p)
+{
+    PrinterEntry *e = NULL;
+
+    if (b->printer_snapshot)
+        e = g_hash_table_lookup(b->printer_snapshot, p->name);
+    return (e && e->config_stamp ? e->config_stamp : "");
+}
+/**
+ * The key under which printers share their options and media: the make
+ * and model, and a hash of everything in the set that was read from the
+ * printer's *-supported and media-col-database attributes. The defaults
+ * are left out, they are the queue's own.
+ */
+static char *get_model_key(PrinterCUPS *p, PrinterCapabilities *caps)
+{
+    const char *make_model = cupsGetOption("printer-make-and-model", p->dest->num_options, p->dest->options);
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    char *key;
+    int i, j;
+
+    /** Strings with their terminating NUL and counts before the values,
+     * so that nothing runs into the next **/
+    for (i = 0; i < caps->num_options; i++)
+    {
+        Option *opt = &caps->options[i];
+        g_checksum_update(checksum, (const guchar *)opt->option_name, strlen(opt->option_name) + 1);
+        g_checksum_update(checksum, (const guchar *)&opt->num_supported, sizeof(int));
+        for (j = 0; j < opt->num_supported; j++)
+            g_checksum_update(checksum, (const guchar *)opt->supported_values[j],
+                              strlen(opt->supported_values[j]) + 1);
     }
-    if (def_attr)
+    for (i = 0; i < caps->num_media; i++)
     {
-        return extract_ipp_attribute(def_attr, 0, option_name);
+        Media *m = &caps->media[i];
+        g_checksum_update(checksum, (const guchar *)m->name, strlen(m->name) + 1);
+        g_checksum_update(checksum, (const guchar *)&m->width, sizeof(int));
+        g_checksum_update(checksum, (const guchar *)&m->length, sizeof(int));
+        g_checksum_update(checksum, (const guchar *)&m->num_margins, sizeof(int));
+        g_checksum_update(checksum, (const guchar *)m->margins, sizeof(int) * 4 * m->num_margins);
     }
-    return g_strdup("NA");
+
+    key = g_strdup_printf("%s\n%s", make_model ? make_model : "", g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+    return key;
 }
-/**************Option************************************/
-Option *get_NA_option()
+/** Query the options and media of the printer; does not touch the BackendObj **/
+static PrinterCapabilities *build_printer_capabilities(PrinterCUPS *p, const char *stamp)
 {
-    Option *o = (Option *)malloc(sizeof(Option));
-    o->option_name = "NA";
-    o->default_value = "NA";
-    o->num_supported = 0;
-    o->supported_values = cpdbNewCStringArray(1);
-    o->supported_values[0] = "bub";
+    PrinterCapabilities *caps = g_new0(PrinterCapabilities, 1);
+
+    caps->ref_count = 1;
+    caps->arena = arena_new(CAPABILITIES_ARENA_BLOCK_SIZE);
+    caps->config_stamp = g_strdup(stamp);
+    caps->num_media = get_all_media(p, caps->arena, &caps->media);
+    caps->num_options = get_all_options(p, caps->arena, &caps->options);
+    caps->num_options = add_media_to_options(p, caps->arena, caps->media, caps->num_media,
+                                             &caps->options, caps->num_options);
+
+    /** A set read without the printer's attributes is not shared **/
+    if (p->attrs)
+    {
+        ipp_attribute_t *attr = ippFindAttribute(p->attrs, "printer-config-change-time",
+                                                 IPP_TAG_INTEGER);
+        if (attr)
+        {
+            g_free(caps->config_stamp);
+            caps->config_stamp = g_strdup_printf("%d", ippGetInteger(attr, 0));
+        }
+        caps->model_key = get_model_key(p, caps);
+        caps->own_translations = (ippFindAttribute(p->attrs, "printer-strings-uri", IPP_TAG_URI) != NULL);
+    }
+    return caps;
+}
+/** A set for a queue with the options and media of the model set **/
+static PrinterCapabilities *new_queue_capabilities(PrinterCapabilities *model, const char *stamp)
+{
+    PrinterCapabilities *caps = g_new0(PrinterCapabilities, 1);
+
+    caps->ref_count = 1;
+    caps->model = ref_PrinterCapabilities(model);
+    caps->config_stamp = g_strdup(stamp);
+    caps->num_options = model->num_options;
+    caps->options = model->options;
+    caps->num_media = model->num_media;
+    caps->media = model->media;
+    return caps;
+}
+/** Give the queue its own default for the option at index i, if it differs **/
+static void set_queue_default(PrinterCapabilities *caps, int i, const char *def)
+{
+    PrinterCapabilities *model = caps->model;
 
-    return o;
+    if (g_strcmp0(def, model->options[i].default_value) == 0)
+        return;
+
+    /** The values and names stay in the model's arena **/
+    if (caps->arena == NULL)
+    {
+        caps->arena = arena_new(QUEUE_ARENA_BLOCK_SIZE);
+        caps->options = arena_alloc(caps->arena, sizeof(Option) * model->num_options);
+        memcpy(caps->options, model->options, sizeof(Option) * model->num_options);
+    }
+    caps->options[i].default_value = arena_strdup(caps->arena, def);
 }
-void print_option(const Option *opt)
+/**
+ * The set of a queue from the set read from it: the model set with the
+ * queue's defaults, which come from its *-default attributes and its
+ * destination options. The sets have the same key, so their options are
+ * the same and in the same order.
+ */
+static PrinterCapabilities *derive_queue_capabilities(PrinterCapabilities *model, PrinterCapabilities *own)
 {
-    g_message("%s", opt->option_name);
+    PrinterCapabilities *caps = new_queue_capabilities(model, own->config_stamp);
     int i;
-    for (i = 0; i < opt->num_supported; i++)
+
+    caps->own_translations = own->own_translations;
+    for (i = 0; i < model->num_options; i++)
+        set_queue_default(caps, i, own->options[i].default_value);
+    return caps;
+}
+/**
+ * Keep a freshly built set for the queue. It becomes the model set, unless
+ * a printer with the same options and media got there first.
+ */
+static PrinterCapabilities *add_printer_capabilities(BackendObj *b, const char *name,
+                                                     PrinterCapabilities *built)
+{
+    PrinterCapabilities *model, *caps = built;
+
+    if (built->model_key)
     {
-        logdebug(" %s\n", opt->supported_values[i]);
+        model = g_hash_table_lookup(b->models, built->model_key);
+        if (model == NULL)
+            g_hash_table_insert(b->models, g_strdup(built->model_key),
+                                model = ref_PrinterCapabilities(built));
+        else
+            logdebug("Sharing the options of %s with other printers\n", name);
+        caps = derive_queue_capabilities(model, built);
+        unref_PrinterCapabilities(built);
     }
-    logdebug("****DEFAULT: %s\n", opt->default_value);
+
+    g_hash_table_insert(b->capabilities, g_strdup(name), caps);
+    schedule_backend_cache_save(b);
+    return caps;
 }
-void free_options(int count, Option *opts)
+/** Drop the model sets no printer uses any more **/
+static void prune_model_capabilities(BackendObj *b)
 {
-    int i, j; /**Looping variables */
-    for (i = 0; i < count; i++)
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, b->models);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        if (g_atomic_int_get(&((PrinterCapabilities *)value)->ref_count) == 1)
+            g_hash_table_iter_remove(&iter);
+}
+PrinterCapabilities *lookup_printer_capabilities(BackendObj *b, PrinterCUPS *p)
+{
+    PrinterCapabilities *caps = g_hash_table_lookup(b->capabilities, p->name);
+    const char *stamp = get_config_stamp(b, p);
+
+    /** Without a known config change time the set is kept until
+     * PrinterModified drops it **/
+    if (caps && (stamp[0] == '\0' || g_strcmp0(caps->config_stamp, stamp) == 0))
+        return caps;
+    if (caps)
     {
-        free(opts[i].option_name);
-        for (j = 0; j < opts[i].num_supported; j++)
-        {
-            free(opts[i].supported_values[j]);
-        }
-        free(opts[i].supported_values);
-        free(opts[i].default_value);
+        logdebug("Configuration of %s changed, dropping its cached options\n", p->name);
+        g_hash_table_remove(b->capabilities, p->name);
+        prune_model_capabilities(b);
     }
-    free(opts);
+    return NULL;
 }
-void unpack_option_array(GVariant *var, int num_options, Option **options)
+PrinterCapabilities *get_printer_capabilities(BackendObj *b, PrinterCUPS *p)
 {
-    Option *opt = (Option *)(malloc(sizeof(Option) * num_options));
-    int i, j;
-    char *str;
-    GVariantIter *iter;
-    GVariantIter *array_iter;
-    char *name, *default_val;
-    int num_sup;
-    g_variant_get(var, "a(ssia(s))", &iter);
-    for (i = 0; i < num_options; i++)
+    PrinterCapabilities *caps = lookup_printer_capabilities(b, p);
+
+    if (caps)
     {
-        //logdebug("i = %d\n", i);
+        logdebug("Using cached options of %s\n", p->name);
+        return caps;
+    }
+    return add_printer_capabilities(b, p->name, build_printer_capabilities(p, get_config_stamp(b, p)));
+}
+GVariant *get_capabilities_reply(PrinterCapabilities *caps)
+{
+    GVariantBuilder options, media;
 
-        g_variant_iter_loop(iter, "(ssia(s))", &name, &default_val,
-                            &num_sup, &array_iter);
-        opt[i].option_name = g_strdup(name);
-        opt[i].default_value = g_strdup(default_val);
-        opt[i].num_supported = num_sup;
-        opt[i].supported_values = cpdbNewCStringArray(num_sup);
-        for (j = 0; j < num_sup; j++)
-        {
-            g_variant_iter_loop(array_iter, "(s)", &str);
-            opt[i].supported_values[j] = g_strdup(str); //mem
-        }
-        print_option(&opt[i]);
+    if (caps->reply)
+        return caps->reply;
+
+    /** A queue without defaults of its own sends what its model sends **/
+    if (caps->model && caps->options == caps->model->options)
+    {
+        caps->reply = g_variant_ref(get_capabilities_reply(caps->model));
+        return caps->reply;
     }
 
-    *options = opt;
+    g_variant_builder_init(&options, G_VARIANT_TYPE("a(sssia(s))"));
+    for (int i = 0; i < caps->num_options; i++)
+        g_variant_builder_add_value(&options, pack_option(&caps->options[i]));
+
+    g_variant_builder_init(&media, G_VARIANT_TYPE("a(siiia(iiii))"));
+    for (int i = 0; i < caps->num_media; i++)
+        g_variant_builder_add_value(&media, pack_media(&caps->media[i]));
+
+    caps->reply = g_variant_ref_sink(g_variant_new("(i@a(sssia(s))i@a(siiia(iiii)))",
+                                                   caps->num_options,
+                                                   g_variant_builder_end(&options),
+                                                   caps->num_media,
+                                                   g_variant_builder_end(&media)));
+    return caps->reply;
 }
-GVariant *pack_option(const Option *opt)
+const char *get_capabilities_etag(PrinterCapabilities *caps)
 {
-    char *group_name = cpdbGetGroup(opt->option_name);
-    GVariant **t = g_new(GVariant *, 5);
-    t[0] = g_variant_new_string(opt->option_name);
-    t[1] = g_variant_new_string(group_name);
-    t[2] = g_variant_new_string(opt->default_value);
-    t[3] = g_variant_new_int32(opt->num_supported);
-    t[4] = cpdbPackStringArray(opt->num_supported, opt->supported_values);
-    GVariant *tuple_variant = g_variant_new_tuple(t, 5);
-    g_free(t);
-    free(group_name);
-    return tuple_variant;
+    GVariant *reply;
+
+    /** A content hash rather than printer-config-change-time, which not
+     * every printer reports and which survives a CUPS restart **/
+    if (caps->model && caps->options == caps->model->options)
+        return get_capabilities_etag(caps->model);
+    if (caps->etag == NULL)
+    {
+        reply = get_capabilities_reply(caps);
+        caps->etag = g_compute_checksum_for_data(G_CHECKSUM_SHA1,
+                                                 g_variant_get_data(reply),
+                                                 g_variant_get_size(reply));
+    }
+    return caps->etag;
 }
-GVariant *pack_media(const Media *media)
+/** The options add_media_to_options() builds from the media sizes **/
+static gboolean is_media_option(const char *option_name)
 {
-	GVariant **t = g_new(GVariant *, 5);
-	t[0] = g_variant_new_string(media->name);
-	t[1] = g_variant_new_int32(media->width);
-	t[2] = g_variant_new_int32(media->length);
-	t[3] = g_variant_new_int32(media->num_margins);
-	t[4] = cpdbPackMediaArray(media->num_margins, media->margins);
-	GVariant *tuple_variant = g_variant_new_tuple(t, 5);
-	g_free(t);
-	return tuple_variant;
+    static const char *const media_options[] = {"media", "media-left-margin",
+                                                "media-right-margin", "media-top-margin",
+                                                "media-bottom-margin"};
+
+    for (guint i = 0; i < G_N_ELEMENTS(media_options); i++)
+        if (strcmp(media_options[i], option_name) == 0)
+            return TRUE;
+    return FALSE;
 }
-int get_all_options(PrinterCUPS *p, Option **options)
+
+static gboolean wants_media(const char *const *option_names)
 {
-    ensure_printer_connection(p);
+    for (int i = 0; option_names[i]; i++)
+        if (is_media_option(option_names[i]))
+            return TRUE;
+    return FALSE;
+}
 
-    char **option_names;
-    int num_options = get_job_creation_attributes(p, &option_names); /** number of options to be returned**/
+/**
+ * Read just the named options (and the media, if asked for) from the
+ * printer, into a set that is not cached
+ */
+static PrinterCapabilities *query_selected_capabilities(PrinterCUPS *p,
+                                                        const char *const *option_names)
+{
+    static const char *const media_attributes[] = {"media-col-database", "media-supported",
+                                                   "media-default", "media-col-default",
+                                                   "media-left-margin-supported",
+                                                   "media-right-margin-supported",
+                                                   "media-top-margin-supported",
+                                                   "media-bottom-margin-supported"};
+    PrinterCapabilities *caps = g_new0(PrinterCapabilities, 1);
+    PrinterCUPS narrow;
+    ipp_t *attrs = p->attrs;
+    GPtrArray *requested = g_ptr_array_new_with_free_func(g_free);
+    const FixedOption *fixed;
+    gboolean media = wants_media(option_names);
+    int i;
 
-    /** Addition options not present in "job-creation-attributes" **/
-    char *additional_options[] = {"media-source", "media-type"}; 
-    int sz = sizeof(additional_options) / sizeof(char *);
+    caps->ref_count = 1;
+    caps->arena = arena_new(CAPABILITIES_ARENA_BLOCK_SIZE);
 
-    /** Add additional attributes to current option_names list **/
-    option_names = realloc(option_names, sizeof(char *) * (num_options+sz)); 
-    for (int i=0; i<sz; i++) 
-        option_names[num_options+i] = g_strdup(additional_options[i]);
-    num_options += sz;
+    /** The full attribute set is there already, nothing to ask for **/
+    if (p->attrs == NULL)
+    {
+        for (i = 0; option_names[i]; i++)
+        {
+            g_ptr_array_add(requested, g_strdup_printf("%s-supported", option_names[i]));
+            g_ptr_array_add(requested, g_strdup_printf("%s-default", option_names[i]));
+        }
+        if (media)
+            for (i = 0; i < G_N_ELEMENTS(media_attributes); i++)
+                g_ptr_array_add(requested, g_strdup(media_attributes[i]));
+
+        attrs = request_printer_attributes(p, requested->len,
+                                           (const char *const *)requested->pdata);
+        if (attrs == NULL)
+        {
+            g_ptr_array_free(requested, TRUE);
+            return caps;
+        }
+        logdebug("Fetched %u attributes of %s\n", requested->len, p->name);
+    }
 
-    int i, j, optsIndex = 0;                                         /**Looping variables **/
+    /** The printer, but seeing only the attributes fetched for this query;
+     * copied after connecting, which may replace the destination **/
+    narrow = *p;
+    narrow.attrs = attrs;
 
-    Option *opts = (Option *)(malloc(sizeof(Option) * (num_options+20))); /**Option array, which will be filled **/
-    ipp_attribute_t *vals;                                                /** Variable to store the values of the options **/
-    
+    caps->options = arena_alloc(caps->arena, sizeof(Option) * g_strv_length((char **)option_names));
+    for (i = 0; option_names[i]; i++)
+    {
+        Option *opt = &caps->options[caps->num_options];
+
+        if ((fixed = find_fixed_option(option_names[i])) != NULL)
+            fill_fixed_option(&narrow, caps->arena, opt, fixed);
+        /** Left out or added with the media sizes, as in get_all_options() **/
+        else if (is_skipped_option(option_names[i]) || is_media_option(option_names[i]))
+            continue;
+        else if (find_printer_supported(&narrow, option_names[i]) ||
+                 find_printer_default(&narrow, option_names[i]))
+            fill_printer_option(&narrow, caps->arena, opt, arena_strdup(caps->arena, option_names[i]));
+        else
+            continue;
+
+        if (strcmp(opt->option_name, "print-quality") == 0)
+            correct_print_quality(caps->arena, opt);
+        caps->num_options++;
+    }
+
+    /** The media options are built along with the media sizes **/
+    if (media)
+    {
+        caps->num_media = get_all_media(&narrow, caps->arena, &caps->media);
+        caps->num_options = add_media_to_options(&narrow, caps->arena, caps->media, caps->num_media,
+                                                 &caps->options, caps->num_options);
+    }
+
+    if (narrow.attrs != p->attrs)
+        ippDelete(narrow.attrs);
+    g_ptr_array_free(requested, TRUE);
+    return caps;
+}
+
+GVariant *get_selected_options_reply(BackendObj *b, PrinterCUPS *p,
+                                     const char *const *option_names)
+{
+    PrinterCapabilities *caps = lookup_printer_capabilities(b, p);
+    PrinterCapabilities *selected = NULL;
+    GVariantBuilder options, media;
+    GHashTable *names;
+    int num_options = 0, num_media = 0;
+
+    if (caps == NULL)
+        caps = selected = query_selected_capabilities(p, option_names);
+    else
+        logdebug("Using cached options of %s\n", p->name);
+
+    /** Only the named options are sent, the media ones come all together **/
+    names = g_hash_table_new(g_str_hash, g_str_equal);
+    for (int i = 0; option_names[i]; i++)
+        g_hash_table_add(names, (gpointer) option_names[i]);
 
-    for (i = 0; i < num_options; i++)
+    g_variant_builder_init(&options, G_VARIANT_TYPE("a(sssia(s))"));
+    for (int i = 0; i < caps->num_options; i++)
     {
-        // Hardcode CUPS specific option
-        if(
-            (strcmp(option_names[i], "booklet") == 0) ||
-            (strcmp(option_names[i], "ipp-attribute-fidelity") == 0) ||
-            (strcmp(option_names[i], "job-sheets") == 0) ||
-            (strcmp(option_names[i], "media") == 0) ||
-            (strcmp(option_names[i], "media-col") == 0) ||
-            (strcmp(option_names[i], "mirror") == 0) ||
-            (strcmp(option_names[i], "multiple-document-handling") == 0) ||
-            (strcmp(option_names[i], "number-up") == 0) ||
-            (strcmp(option_names[i], "number-up-layout") == 0) ||
-            (strcmp(option_names[i], "orientation-requested") == 0) ||
-            (strcmp(option_names[i], "page-border") == 0) ||
-            (strcmp(option_names[i], "page-delivery") == 0) ||
-            (strcmp(option_names[i], "page-set") == 0) ||
-            (strcmp(option_names[i], "position") == 0) ||
-            (strcmp(option_names[i], "print-scaling") == 0)
-        )
+        if (!g_hash_table_remove(names, caps->options[i].option_name))
             continue;
+        g_variant_builder_add_value(&options, pack_option(&caps->options[i]));
+        num_options++;
+    }
 
-        opts[optsIndex].option_name = option_names[i];
-        vals = cupsFindDestSupported(p->http, p->dest, p->dinfo, option_names[i]);
-        if (vals)
-            opts[optsIndex].num_supported = ippGetCount(vals);
-        else
-            opts[optsIndex].num_supported = 0;
+    g_variant_builder_init(&media, G_VARIANT_TYPE("a(siiia(iiii))"));
+    if (g_strv_contains(option_names, "media"))
+    {
+        for (int i = 0; i < caps->num_media; i++)
+            g_variant_builder_add_value(&media, pack_media(&caps->media[i]));
+        num_media = caps->num_media;
+    }
 
-        /** Retreive all the supported values for that option **/
-        opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-        for (j = 0; j < opts[optsIndex].num_supported; j++)
-        {
-            opts[optsIndex].supported_values[j] = extract_ipp_attribute(vals, j, option_names[i]);
-            if (opts[optsIndex].supported_values[j] == NULL)
-            {
-                opts[optsIndex].supported_values[j] = g_strdup("NA");
-            }
-        }
+    g_hash_table_destroy(names);
+    if (selected)
+        unref_PrinterCapabilities(selected);
+    return g_variant_new("(i@a(sssia(s))i@a(siiia(iiii)))",
+                         num_options, g_variant_builder_end(&options),
+                         num_media, g_variant_builder_end(&media));
+}
+void invalidate_printer_capabilities(BackendObj *b, const char *queue_name)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    gboolean removed = FALSE;
 
-        /** Retrieve the default value for that option **/
-        opts[optsIndex].default_value = get_default(p, option_names[i]);
-        if (opts[optsIndex].default_value == NULL)
+    g_hash_table_iter_init(&iter, b->capabilities);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        if (printer_name_is_queue(key, queue_name))
         {
-            opts[optsIndex].default_value = g_strdup("NA");
+            logdebug("Dropping cached options of %s\n", (char *)key);
+            g_hash_table_iter_remove(&iter);
+            removed = TRUE;
         }
+    }
+    b->capabilities_generation++;
 
-        optsIndex++;
+    /** Don't let the next start serve them from the cache file **/
+    if (removed)
+    {
+        prune_model_capabilities(b);
+        schedule_backend_cache_save(b);
     }
 
-    /* Add the booklet option */
-    opts[optsIndex].option_name = g_strdup("booklet");
-    opts[optsIndex].num_supported = 3;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = g_strdup("off");
-    opts[optsIndex].supported_values[1] = g_strdup("on");
-    opts[optsIndex].supported_values[2] = g_strdup("shuffle-only");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the ipp-attribute-fidelity option */
-    opts[optsIndex].option_name = g_strdup("ipp-attribute-fidelity");
-    opts[optsIndex].num_supported = 2;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = g_strdup("off");
-    opts[optsIndex].supported_values[1] = g_strdup("on");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the job-sheets option */
-    opts[optsIndex].option_name = g_strdup("job-sheets");
-    opts[optsIndex].num_supported = 8;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = g_strdup("none");
-    opts[optsIndex].supported_values[1] = g_strdup("classified");
-    opts[optsIndex].supported_values[2] = g_strdup("confidential");
-    opts[optsIndex].supported_values[3] = g_strdup("form");
-    opts[optsIndex].supported_values[4] = g_strdup("secret");
-    opts[optsIndex].supported_values[5] = g_strdup("standard");
-    opts[optsIndex].supported_values[6] = g_strdup("topsecret");
-    opts[optsIndex].supported_values[7] = g_strdup("unclassified");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = g_strdup("none,none");
-    }
-    optsIndex++;
-
-    /* Add the mirror option */
-    opts[optsIndex].option_name = g_strdup("mirror");
-    opts[optsIndex].num_supported = 2;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = g_strdup("off");
-    opts[optsIndex].supported_values[1] = g_strdup("on");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the multiple-document-handling option */
-    opts[optsIndex].option_name = g_strdup("multiple-document-handling");
-    opts[optsIndex].num_supported = 2;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = g_strdup("separate-documents-uncollated-copies");
-    opts[optsIndex].supported_values[1] = g_strdup("separate-documents-collated-copies");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the number-up option */
-    opts[optsIndex].option_name = g_strdup("number-up");
-    opts[optsIndex].num_supported = 6;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = g_strdup("1");
-    opts[optsIndex].supported_values[1] = g_strdup("2");
-    opts[optsIndex].supported_values[2] = g_strdup("4");
-    opts[optsIndex].supported_values[3] = g_strdup("6");
-    opts[optsIndex].supported_values[4] = g_strdup("9");
-    opts[optsIndex].supported_values[5] = g_strdup("16");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the number-up-layout option */
-    opts[optsIndex].option_name = g_strdup("number-up-layout");
-    opts[optsIndex].num_supported = 8;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = g_strdup("lrtb");
-    opts[optsIndex].supported_values[1] = g_strdup("lrbt");
-    opts[optsIndex].supported_values[2] = g_strdup("rltb");
-    opts[optsIndex].supported_values[3] = g_strdup("rlbt");
-    opts[optsIndex].supported_values[4] = g_strdup("tblr");
-    opts[optsIndex].supported_values[5] = g_strdup("tbrl");
-    opts[optsIndex].supported_values[6] = g_strdup("btlr");
-    opts[optsIndex].supported_values[7] = g_strdup("btrl");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the orientation-requested option */
-    opts[optsIndex].option_name = g_strdup("orientation-requested");
-    opts[optsIndex].num_supported = 4;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = g_strdup("3");
-    opts[optsIndex].supported_values[1] = g_strdup("4");
-    opts[optsIndex].supported_values[2] = g_strdup("5");
-    opts[optsIndex].supported_values[3] = g_strdup("6");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[0]);
+    invalidate_printer_strings(queue_name);
+
+    /** The dialogs' printers have to ask for the attributes again too **/
+    g_hash_table_iter_init(&iter, b->dialogs);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        Dialog *d = value;
+        GHashTableIter piter;
+        gpointer pkey, pvalue;
+
+        g_hash_table_iter_init(&piter, d->printers);
+        while (g_hash_table_iter_next(&piter, &pkey, &pvalue))
+            if (printer_name_is_queue(pkey, queue_name))
+                reset_printer_attributes(pvalue);
     }
-    else
+}
+/** A printer whose options are fetched on a prefetch worker **/
+typedef struct _PrefetchJob
+{
+    BackendObj *b;
+    /** a private copy, with its own connection to the printer **/
+    PrinterCUPS *printer;
+    char *config_stamp;
+    guint generation;
+    GCancellable *cancellable;
+    /** the result, NULL if cancelled **/
+    PrinterCapabilities *caps;
+} PrefetchJob;
+
+typedef struct _PrefetchWaiter
+{
+    PrefetchDoneFunc func;
+    gpointer user_data;
+} PrefetchWaiter;
+
+/** Back on the main loop: keep the result unless it has gone stale **/
+static gboolean prefetch_done(gpointer user_data)
+{
+    PrefetchJob *job = user_data;
+    BackendObj *b = job->b;
+    const char *name = job->printer->name;
+    GList *waiters, *l;
+
+    waiters = g_hash_table_lookup(b->prefetching, name);
+    g_hash_table_remove(b->prefetching, name);
+    if (job->caps && job->generation == b->capabilities_generation &&
+        !g_hash_table_contains(b->capabilities, name))
     {
-        if (strcmp(opts[optsIndex].default_value, "potrait") == 0)
-            opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[0]);
-        else if (strcmp(opts[optsIndex].default_value, "landscape") == 0)
-            opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[1]);
-        else if (strcmp(opts[optsIndex].default_value, "reverse-landscape") == 0)
-            opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[2]);
-        else if (strcmp(opts[optsIndex].default_value, "reverse-potrait") == 0)
-            opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[3]);
-        else
-            opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the page-border option */
-    opts[optsIndex].option_name = g_strdup("page-border");
-    opts[optsIndex].num_supported = 5;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = g_strdup("none");
-    opts[optsIndex].supported_values[1] = g_strdup("single");
-    opts[optsIndex].supported_values[2] = g_strdup("single-thick");
-    opts[optsIndex].supported_values[3] = g_strdup("double");
-    opts[optsIndex].supported_values[4] = g_strdup("double-thick");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the page-delivery option */
-    opts[optsIndex].option_name = g_strdup("page-delivery");
-    opts[optsIndex].num_supported = 2;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = g_strdup("same-order");
-    opts[optsIndex].supported_values[1] = g_strdup("reverse-order");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the page-set option */
-    opts[optsIndex].option_name = g_strdup("page-set");
-    opts[optsIndex].num_supported = 3;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = g_strdup("all");
-    opts[optsIndex].supported_values[1] = g_strdup("even");
-    opts[optsIndex].supported_values[2] = g_strdup("odd");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the position option */
-    opts[optsIndex].option_name = g_strdup("position");
-    opts[optsIndex].num_supported = 9;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = g_strdup("center");
-    opts[optsIndex].supported_values[1] = g_strdup("top");
-    opts[optsIndex].supported_values[2] = g_strdup("bottom");
-    opts[optsIndex].supported_values[3] = g_strdup("left");
-    opts[optsIndex].supported_values[4] = g_strdup("right");
-    opts[optsIndex].supported_values[5] = g_strdup("top-left");
-    opts[optsIndex].supported_values[6] = g_strdup("top-right");
-    opts[optsIndex].supported_values[7] = g_strdup("bottom-left");
-    opts[optsIndex].supported_values[8] = g_strdup("bottom-right");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the print-scaling option */
-    opts[optsIndex].option_name = g_strdup("print-scaling");
-    opts[optsIndex].num_supported = 5;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = g_strdup("auto");
-    opts[optsIndex].supported_values[1] = g_strdup("auto-fit");
-    opts[optsIndex].supported_values[2] = g_strdup("fill");
-    opts[optsIndex].supported_values[3] = g_strdup("fit");
-    opts[optsIndex].supported_values[4] = g_strdup("none");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = g_strdup(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the billing-info option */
-    opts[optsIndex].option_name = g_strdup("billing-info");
-    opts[optsIndex].num_supported = 0;
-    opts[optsIndex].supported_values = NULL;
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = g_strdup("");
-    }
-    optsIndex++;
+        logdebug("Prefetched the options of %s\n", name);
+        add_printer_capabilities(b, name, job->caps);
+        job->caps = NULL;
+    }
 
-    /* Correct the print-quality option */
-    for (i = 0; i < optsIndex; i++)
+    if (job->caps)
+        unref_PrinterCapabilities(job->caps);
+    if (job->printer->http)
+        httpClose(job->printer->http);
+    free_PrinterCUPS(job->printer);
+    free(job->printer);
+    g_free(job->config_stamp);
+    g_object_unref(job->cancellable);
+    g_free(job);
+
+    /** Whatever became of the prefetch, the waiting requests go on **/
+    for (l = waiters; l != NULL; l = l->next)
     {
-        if (strcmp(opts[i].option_name, "print-quality") == 0)
-        {
-            for (j = 0; j < opts[i].num_supported; j++)
-            {
-                if (strcasecmp(opts[i].supported_values[j], "draft") == 0)
-                {
-                    free(opts[i].supported_values[j]);
-                    opts[i].supported_values[j] = g_strdup("3");
-                    continue;
-                }
-                if (strcasecmp(opts[i].supported_values[j], "normal") == 0)
-                {
-                    free(opts[i].supported_values[j]);
-                    opts[i].supported_values[j] = g_strdup("4");
-                    continue;
-                }
-                if (strcasecmp(opts[i].supported_values[j], "high") == 0)
-                {
-                    free(opts[i].supported_values[j]);
-                    opts[i].supported_values[j] = g_strdup("5");
-                    continue;
-                }
-            }
+        PrefetchWaiter *w = l->data;
+        w->func(b, w->user_data);
+        g_free(w);
+    }
+    g_list_free(waiters);
+    return G_SOURCE_REMOVE;
+}
 
-            if (strcasecmp(opts[i].default_value, "draft") == 0)
-            {
-                free(opts[i].default_value);
-                opts[i].default_value = g_strdup("3");
-                continue;
-            }
-            if (strcasecmp(opts[i].default_value, "normal") == 0)
-            {
-                free(opts[i].default_value);
-                opts[i].default_value = g_strdup("4");
-                continue;
-            }
-            if (strcasecmp(opts[i].default_value, "high") == 0)
-            {
-                free(opts[i].default_value);
-                opts[i].default_value = g_strdup("5");
-                continue;
-            }
+void when_prefetch_done(BackendObj *b, const char *printer_name,
+                        PrefetchDoneFunc func, gpointer user_data)
+{
+    PrefetchWaiter *w;
+    gpointer key, waiters;
 
-            break;
-        }
+    if (!g_hash_table_lookup_extended(b->prefetching, printer_name, &key, &waiters))
+    {
+        func(b, user_data);
+        return;
     }
 
-    *options = (Option *) realloc(opts, sizeof(Option) * optsIndex);
-    return optsIndex;
+    logdebug("Waiting for the prefetch of %s\n", printer_name);
+    w = g_new(PrefetchWaiter, 1);
+    w->func = func;
+    w->user_data = user_data;
+    g_hash_table_insert(b->prefetching, g_strdup(key), g_list_append(waiters, w));
 }
-int get_all_media(PrinterCUPS *p, Media **medias)
-{	
-	ensure_printer_connection(p);
-	ipp_t *request = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
-	const char *uri = cupsGetOption("printer-uri-supported", 
-									p->dest->num_options,
-									p->dest->options);
-	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
-                 "printer-uri", NULL, uri);
-    const char *const requested_attributes[] = {"media-col-database"};
-    ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
-                  "requested-attributes", 1, NULL,
-                  requested_attributes);
 
-    ipp_t *response = cupsDoRequest(p->http, request, "/");
-    if (cupsLastError() >= IPP_STATUS_ERROR_BAD_REQUEST)
+/* Runs on a prefetch worker, must not touch the BackendObj */
+static void prefetch_worker(gpointer data, gpointer user_data)
+{
+    PrefetchJob *job = data;
+
+    if (!g_cancellable_is_cancelled(job->cancellable))
+        job->caps = build_printer_capabilities(job->printer, job->config_stamp);
+
+    /** The dialog may have gone while the printer was asked **/
+    if (job->caps && g_cancellable_is_cancelled(job->cancellable))
     {
-        /* request failed */
-        logerror("Request failed: %s\n", cupsLastErrorString());
-        return 0;
+        unref_PrinterCapabilities(job->caps);
+        job->caps = NULL;
     }
-    
-    int media_num = 0;				/** Number of unqiue media sizes **/
-    Media *meds = NULL;				/** Array of unique media sizes **/
+    g_idle_add(prefetch_done, job);
+}
 
-    ipp_attribute_t *mdb; // media database
-    if ((mdb = ippFindAttribute(response, "media-col-database", IPP_TAG_BEGIN_COLLECTION)) != NULL)
+/** Returns whether a fetch has been queued **/
+static gboolean queue_prefetch(BackendObj *b, Dialog *d, PrinterCUPS *p)
+{
+    PrefetchJob *job;
+    PrinterEntry *e = NULL;
+
+    if (b->printer_snapshot)
+        e = g_hash_table_lookup(b->printer_snapshot, p->name);
+
+    /** Don't set up temporary queues just in case they get used **/
+    if ((e && e->is_temporary) || cups_is_temporary(p->dest))
+        return FALSE;
+    if (g_hash_table_contains(b->prefetching, p->name) || lookup_printer_capabilities(b, p))
+        return FALSE;
+
+    job = g_new0(PrefetchJob, 1);
+    job->b = b;
+    job->printer = get_new_PrinterCUPS(e ? e->dest : p->dest);
+    if (job->printer == NULL)
     {
-		int i, j;
-		gpointer key, value;		/** Looping variables **/
-		
-        const char *name;			/** PWG name for a media **/
-		int width, length;			/** Width and length of a media **/
-		pwg_media_t *pwg_media;
-		
-		ipp_t *tuple; 				/** Single media entry in media-col-database **/
-		ipp_t *media_size;			/** media-size collection in a media tuple **/ 
-		ipp_attribute_t *attr;		/** Temporary variable for ipp attributes in a single tuple **/
-		
-		typedef struct Margin {
-			int left;
-			int right;
-			int top;
-			int bottom;
-		} Margin;
-        
-        Margin *margin;				/** Single margin struct for some media size**/
-		GList *margins, *listIter;	/** List of all different margins for some media size **/
-		GHashTable *table;			/** [media-size]-->[margins] **/
-		GHashTableIter iter;		/** For iterating over the table **/
-		
-		table = g_hash_table_new(g_str_hash, g_str_equal);
-		
-		int count = ippGetCount(mdb);
-		for (int i = 0; i < count; i++)
-		{
-			tuple = ippGetCollection(mdb, i);
-			
-			attr = ippFindAttribute(tuple, "media-size", IPP_TAG_BEGIN_COLLECTION);
-			media_size = ippGetCollection(attr, 0);
-			attr = ippFindAttribute(media_size, "x-dimension", IPP_TAG_INTEGER);
-			width = ippGetInteger(attr, 0);
-			attr = ippFindAttribute(media_size, "y-dimension", IPP_TAG_INTEGER);
-			length = ippGetInteger(attr, 0);
+        g_free(job);
+        return FALSE;
+    }
+    job->config_stamp = g_strdup(get_config_stamp(b, p));
+    job->generation = b->capabilities_generation;
+    job->cancellable = g_object_ref(d->prefetch_cancel);
 
-			if (width <= 0 || length <= 0)
-			  continue;
+    g_hash_table_insert(b->prefetching, g_strdup(p->name), NULL);
+    g_thread_pool_push(b->prefetch_pool, job, NULL);
+    return TRUE;
+}
 
-			pwg_media = pwgMediaForSize(width, length);
-			name = pwg_media->pwg;
-
-			margin = g_new0(Margin, 1);
-
-			attr = ippFindAttribute(tuple, "media-left-margin", IPP_TAG_INTEGER);
-			margin->left = ippGetInteger(attr, 0);
-			attr = ippFindAttribute(tuple, "media-right-margin", IPP_TAG_INTEGER);
-			margin->right = ippGetInteger(attr, 0);
-			attr = ippFindAttribute(tuple, "media-top-margin", IPP_TAG_INTEGER);
-			margin->top = ippGetInteger(attr, 0);
-			attr = ippFindAttribute(tuple, "media-bottom-margin", IPP_TAG_INTEGER);
-			margin->bottom = ippGetInteger(attr, 0);
-			
-			margins = g_hash_table_lookup(table, name);
-			margins = g_list_prepend(margins, margin);
-			g_hash_table_replace(table, (gpointer) name, margins);
-		}
-		
-		media_num = g_hash_table_size(table);
-        meds = g_new0 (Media, media_num);
-		
-		i = 0;
-		g_hash_table_iter_init(&iter, table);
-		while (g_hash_table_iter_next(&iter, &key, &value))
-		{
-            name = (char *) key;
-            pwg_media = pwgMediaForPWG(name);
-
-			margins = (GList *) value;
-            margins = g_list_reverse(margins);
-            
-            meds[i].name = g_strdup(name);
-            meds[i].width = pwg_media->width;
-            meds[i].length = pwg_media->length;
-            meds[i].num_margins = g_list_length(margins);
-            meds[i].margins = malloc(sizeof(int) * meds[i].num_margins * 4);
-            
-            j = 0;
-            listIter = margins;
-            while (listIter != NULL)
-            {
-				margin = (Margin *) listIter->data;
-				
-				meds[i].margins[j][0] = margin->left;
-				meds[i].margins[j][1] = margin->right;
-				meds[i].margins[j][2] = margin->top;
-				meds[i].margins[j][3] = margin->bottom;
+void prefetch_printer_capabilities(BackendObj *b, const char *dialog_name)
+{
+    Dialog *d = find_dialog(b, dialog_name);
+    GHashTableIter iter;
+    gpointer key, value;
+    GPtrArray *used;
+    PrinterCUPS *p;
+    guint queued = 0;
 
-				free(margin);
+    if (b->prefetch_pool == NULL || d == NULL || b->prefetch_count == 0)
+        return;
 
-				listIter = listIter->next;
-				j++;
-			}
-			g_list_free(margins);
-			i++;
-		}
+    /** The default printer is the one most dialogs open with **/
+    g_hash_table_iter_init(&iter, d->printers);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        p = value;
+        if (p->dest->is_default)
+        {
+            if (queue_prefetch(b, d, p))
+                queued++;
+            break;
+        }
+    }
 
-		g_hash_table_destroy(table);
-	}
-	
-	ippDelete(response);
-	
-	*medias = meds;
-	return media_num;
+    /** Then the printers the user prints to the most; those cached or
+     * already on their way don't count **/
+    used = g_ptr_array_new();
+    g_hash_table_iter_init(&iter, d->printers);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        if (!((PrinterCUPS *)value)->dest->is_default && get_printer_usage_score(b, key) > 0)
+            g_ptr_array_add(used, key);
+    g_ptr_array_sort_with_data(used, compare_printer_usage, b);
+    for (guint i = 0; i < used->len && queued < b->prefetch_count; i++)
+    {
+        if (queue_prefetch(b, d, g_hash_table_lookup(d->printers, used->pdata[i])))
+            queued++;
+    }
+
+    /** And the ones configured, if there is room left **/
+    for (int i = 0; b->prefetch_printers[i] && queued < b->prefetch_count; i++)
+    {
+        p = g_hash_table_lookup(d->printers, b->prefetch_printers[i]);
+        if (p && !p->dest->is_default && !g_ptr_array_find_with_equal_func(used, p->name, g_str_equal, NULL) &&
+            queue_prefetch(b, d, p))
+            queued++;
+    }
+    g_ptr_array_free(used, TRUE);
 }
-int add_media_to_options(PrinterCUPS *p, Media *medias, int media_count, Option **options, int count)
+int add_media_to_options(PrinterCUPS *p, Arena *arena, Media *medias, int media_count, Option **options, int count)
 {
     int i, j;							/** Looping variables **/
     int num_media;						/** Variable for number of "media" supported using CUPS call **/
@@ -1293,27 +2787,27 @@ int add_media_to_options(PrinterCUPS *p, Media *medias, int media_count, Option
     ipp_attribute_t *vals, *default_val, *attr;
 
     count += 5;	/** "media", "media-{top, bottom, left, right}-margins" **/
-    Option *opts = *options;
-    
-    opts = realloc(opts, sizeof(Option) * count);
+    Option *opts = arena_alloc(arena, sizeof(Option) * count);
+    memcpy(opts, *options, sizeof(Option) * optsIndex);
     
      /* Add the media option */
-    opts[optsIndex].option_name = g_strdup("media");
+    opts[optsIndex].option_name = arena_strdup(arena, "media");
+    opts[optsIndex].fixed_index = -1;
 	opts[optsIndex].num_supported = media_count;
-	opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported + 2);	/** 2 extra for custom_min and custom_max sizes **/
+	opts[optsIndex].supported_values = arena_alloc(arena, sizeof(char *) * (opts[optsIndex].num_supported + 3));	/** 2 extra for custom_min and custom_max sizes **/
 	for (i = 0; i < opts[optsIndex].num_supported; i++)
     {
-        opts[optsIndex].supported_values[i] = g_strdup(medias[i].name);
+        opts[optsIndex].supported_values[i] = medias[i].name;
     }
 
-    opts[optsIndex].default_value = get_default(p, "media");
+    opts[optsIndex].default_value = arena_take_string(arena, get_default(p, "media"));
     if (opts[optsIndex].default_value == NULL)
     {
-        opts[optsIndex].default_value = g_strdup("NA");
+        opts[optsIndex].default_value = arena_strdup(arena, "NA");
     }
     
     /** Add custom_min and custom_max media if they exist **/
-    vals = cupsFindDestSupported(p->http, p->dest, p->dinfo, "media");
+    vals = find_printer_supported(p, "media");
     if (vals)
 		num_media = ippGetCount(vals);
 	else
@@ -1321,14 +2815,14 @@ int add_media_to_options(PrinterCUPS *p, Media *medias, int media_count, Option
 	
 	for (j = 0; j < num_media && i < (media_count + 2); j++)
 	{
-		media_name = extract_ipp_attribute(vals, i, "media");
+		media_name = extract_ipp_attribute(vals, j, "media");
 		
 		if (media_name == NULL)
 			continue;
 		
 		if (strncmp(media_name, "custom_min", 10) == 0 || strncmp(media_name, "custom_max", 10) == 0)
 		{
-            opts[optsIndex].supported_values[i] = g_strdup(media_name);
+            opts[optsIndex].supported_values[i] = arena_strdup(arena, media_name);
 			i++;
 		}
 		
@@ -1342,24 +2836,25 @@ int add_media_to_options(PrinterCUPS *p, Media *medias, int media_count, Option
     char def[16];
     char *attrs[] = {"media-left-margin", "media-bottom-margin", "media-top-margin", "media-right-margin"};
 
-    default_val = cupsFindDestDefault(p->http, p->dest, p->dinfo, "media-col");
+    default_val = find_printer_default(p, "media-col");
     
     for (i = 0; i < 4; i++) // for each attr in attrs
     {
-        vals = cupsFindDestSupported(p->http, p->dest, p->dinfo, attrs[i]);
-        opts[optsIndex].option_name = g_strdup(attrs[i]);
+        vals = find_printer_supported(p, attrs[i]);
+        opts[optsIndex].option_name = arena_strdup(arena, attrs[i]);
+        opts[optsIndex].fixed_index = -1;
         if (vals)
             opts[optsIndex].num_supported = ippGetCount(vals);
         else
             opts[optsIndex].num_supported = 0;
 
-        opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
+        opts[optsIndex].supported_values = arena_alloc(arena, sizeof(char *) * (opts[optsIndex].num_supported + 1));
         for (j = 0; j < opts[optsIndex].num_supported; j++)
         {
-            opts[optsIndex].supported_values[j] = extract_ipp_attribute(vals, j, attrs[i]);
+            opts[optsIndex].supported_values[j] = arena_take_string(arena, extract_ipp_attribute(vals, j, attrs[i]));
             if (opts[optsIndex].supported_values[j] == NULL)
             {
-                opts[optsIndex].supported_values[j] = g_strdup("NA");
+                opts[optsIndex].supported_values[j] = arena_strdup(arena, "NA");
             }
         }
 
@@ -1367,11 +2862,7 @@ int add_media_to_options(PrinterCUPS *p, Media *medias, int media_count, Option
         attr = ippFindAttribute(media_col, attrs[i], IPP_TAG_INTEGER);
         snprintf(def, 16, "%d", ippGetInteger(attr, 0));
 
-        opts[optsIndex].default_value = g_strdup(def);
-        if (opts[optsIndex].default_value == NULL)
-        {
-            opts[optsIndex].default_value = g_strdup("NA");
-        }
+        opts[optsIndex].default_value = arena_strdup(arena, def);
 
         optsIndex++;
     }
@@ -1417,7 +2908,7 @@ const char *get_printer_state(PrinterCUPS *p)
 
 void print_socket(PrinterCUPS *p, int num_settings, GVariant *settings, char *job_id_str, char *socket_path, const char *title)
 {
-    ensure_printer_connection(p);
+    ensure_printer_dinfo(p);
     int num_options = 0;
     cups_option_t *options;
 
@@ -1507,76 +2998,556 @@ void print_socket(PrinterCUPS *p, int num_settings, GVariant *settings, char *jo
 
 }
 
-void *print_data_thread(void *data) {
-    PrintDataThreadData *thread_data = (PrintDataThreadData *)data;
+void *print_data_thread(void *data) {
+    PrintDataThreadData *thread_data = (PrintDataThreadData *)data;
+
+    // Allocate dynamic memory for the buffer within the thread
+    char *buffer = g_malloc(1024);
+
+    // Accept incoming connections
+    int client_fd = accept(thread_data->socket_fd, NULL, NULL);
+    if (client_fd == -1) {
+        perror("Error accepting connection");
+        close(thread_data->socket_fd);
+    }
+
+    // Placeholder logic for reading data from the socket
+    ssize_t bytesRead;
+    while ((bytesRead = read(client_fd, buffer, 1024)) > 0) {
+        // Send data to CUPS using cupsWriteRequestData
+        http_status_t http_status = cupsWriteRequestData(thread_data->printer->http, buffer, bytesRead);
+        if (http_status != HTTP_STATUS_CONTINUE) {
+            logerror("Error writing print data to server.\n");
+            break;
+        }
+    }
+
+    // Cleanup and free resources
+    close(thread_data->socket_fd);
+    if (cupsFinishDestDocument(thread_data->printer->http, thread_data->printer->dest, thread_data->printer->dinfo) == IPP_STATUS_OK)
+        logdebug("Document send succeeded.\n");
+    else
+        logerror("Document send failed: %s\n", cupsLastErrorString());
+    cupsFreeOptions(thread_data->num_options, thread_data->options);
+    g_free(thread_data);
+    g_free(buffer);
+
+    return NULL;
+}
+
+void printAllJobs(PrinterCUPS *p)
+{
+    ensure_printer_connection(p);
+    cups_job_t *jobs;
+    int num_jobs = cupsGetJobs2(p->http, &jobs, p->name, 1, CUPS_WHICHJOBS_ALL);
+    for (int i = 0; i < num_jobs; i++)
+    {
+        print_job(&jobs[i]);
+    }
+}
+static void list_group(ppd_file_t *ppd,    /* I - PPD file */
+                       ppd_group_t *group) /* I - Group to show */
+{
+    logdebug("List group %s\n", group->name);
+    /** Now iterate through the options in the particular group*/
+    logdebug("It has %d options.\n", group->num_options);
+    logdebug("Listing all of them ..\n");
+    int i;
+    for (i = 0; i < group->num_options; i++)
+    {
+        logdebug("    Option %d : %s\n", i, group->options[i].keyword);
+    }
+}
+
+
+/*********Persistent cache*****************/
+
+/**
+ * The cache file is a serialized GVariant:
+ *  magic, version,
+ *  printers: (name, dest name, instance, is default, is temporary, is remote, options),
+ *  models: (model key, options (name, default, values), media,
+ *           translations by locale),
+ *  option sets: (printer name, config stamp, model key, own translations,
+ *                the defaults differing from the model's, translations by locale)
+ */
+#define BACKEND_CACHE_FORMAT "(sua(ssssbbba{ss})a(sa(ssas)a(siia(iiii))a{sa{ss}})a(sssba{ss}a{sa{ss}}))"
+
+static char *get_backend_cache_path()
+{
+    return g_build_filename(g_get_user_cache_dir(), BACKEND_CACHE_DIR,
+                            BACKEND_CACHE_FILE, NULL);
+}
+
+static PrinterEntry *unpack_cached_PrinterEntry(GVariant *v)
+{
+    PrinterEntry *e;
+    cups_dest_t *dest;
+    const char *name, *dest_name, *instance, *config_stamp, *key, *value;
+    gboolean is_default, is_temporary, is_remote;
+    GVariantIter *opts;
+
+    g_variant_get(v, "(&s&s&s&sbbba{ss})", &name, &dest_name, &instance, &config_stamp,
+                  &is_default, &is_temporary, &is_remote, &opts);
+
+    /** Allocated like libcups does, so that cupsFreeDests() can free it **/
+    dest = calloc(1, sizeof(cups_dest_t));
+    dest->name = strdup(dest_name);
+    dest->instance = (instance[0] ? strdup(instance) : NULL);
+    dest->is_default = is_default;
+    while (g_variant_iter_next(opts, "{&s&s}", &key, &value))
+        dest->num_options = cupsAddOption(key, value, dest->num_options, &dest->options);
+    g_variant_iter_free(opts);
+
+    e = g_new0(PrinterEntry, 1);
+    e->ref_count = 1;
+    e->name = g_strdup(name);
+    e->dest = dest;
+    e->is_temporary = is_temporary;
+    e->is_remote = is_remote;
+    e->config_stamp = (config_stamp[0] ? g_strdup(config_stamp) : NULL);
+    return e;
+}
+
+/** Maps locale(char*) to the a{ss} dictionary (GVariant*) **/
+static GHashTable *new_translations_table()
+{
+    return g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                 (GDestroyNotify)g_variant_unref);
+}
+
+/** The dictionaries are kept as they are in the mapped file; NULL if none **/
+static GHashTable *unpack_cached_translations(GVariant *translations)
+{
+    GHashTable *table;
+    GVariantIter iter;
+    GVariant *dict;
+    const char *locale;
+
+    if (g_variant_n_children(translations) == 0)
+        return NULL;
+
+    table = new_translations_table();
+    g_variant_iter_init(&iter, translations);
+    while (g_variant_iter_next(&iter, "{&s@a{ss}}", &locale, &dict))
+        g_hash_table_insert(table, g_strdup(locale), dict);
+    return table;
+}
+
+static PrinterCapabilities *unpack_cached_capabilities(GVariant *options, GVariant *media)
+{
+    PrinterCapabilities *caps = g_new0(PrinterCapabilities, 1);
+    Arena *arena = arena_new(CAPABILITIES_ARENA_BLOCK_SIZE);
+    GVariantIter iter, *values;
+    GVariant *margins;
+    const char *name, *def, *value;
+    gconstpointer table;
+    gsize num_margins;
+    int i, j, width, length;
+
+    caps->ref_count = 1;
+    caps->num_options = g_variant_n_children(options);
+    caps->arena = arena;
+    caps->options = arena_alloc(arena, sizeof(Option) * caps->num_options);
+    g_variant_iter_init(&iter, options);
+    for (i = 0; g_variant_iter_next(&iter, "(&s&sas)", &name, &def, &values); i++)
+    {
+        caps->options[i].option_name = arena_strdup(arena, name);
+        caps->options[i].fixed_index = -1;
+        caps->options[i].default_value = arena_strdup(arena, def);
+        caps->options[i].num_supported = g_variant_iter_n_children(values);
+        caps->options[i].supported_values = arena_alloc(arena, sizeof(char *) * (caps->options[i].num_supported + 1));
+        for (j = 0; g_variant_iter_next(values, "&s", &value); j++)
+            caps->options[i].supported_values[j] = arena_strdup(arena, value);
+        g_variant_iter_free(values);
+    }
+
+    caps->num_media = g_variant_n_children(media);
+    caps->media = arena_alloc(arena, sizeof(Media) * caps->num_media);
+    g_variant_iter_init(&iter, media);
+    for (i = 0; g_variant_iter_next(&iter, "(&sii@a(iiii))", &name, &width, &length, &margins); i++)
+    {
+        Media *m = &caps->media[i];
+        m->name = arena_strdup(arena, name);
+        m->width = width;
+        m->length = length;
+        table = g_variant_get_fixed_array(margins, &num_margins, sizeof(int) * 4);
+        m->num_margins = num_margins;
+        m->margins = arena_alloc(arena, sizeof(int) * 4 * num_margins);
+        memcpy(m->margins, table, sizeof(int) * 4 * num_margins);
+        g_variant_unref(margins);
+    }
+
+    return caps;
+}
+
+void load_backend_cache(BackendObj *b)
+{
+    char *path = get_backend_cache_path();
+    GMappedFile *file;
+    GBytes *bytes;
+    GVariant *cache, *printers, *models, *option_sets, *child;
+    GVariantIter iter;
+    GError *error = NULL;
+    const char *magic;
+    guint32 version;
+    guint unstamped = 0;
+
+    file = g_mapped_file_new(path, FALSE, &error);
+    if (file == NULL)
+    {
+        logdebug("No cache to load from %s: %s\n", path, error->message);
+        g_error_free(error);
+        g_free(path);
+        return;
+    }
+
+    /** The mapping is kept alive by the bytes as long as the variant uses it **/
+    bytes = g_mapped_file_get_bytes(file);
+    g_mapped_file_unref(file);
+    cache = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE(BACKEND_CACHE_FORMAT),
+                                                        bytes, FALSE));
+    g_bytes_unref(bytes);
+
+    g_variant_get(cache, "(&su@a(ssssbbba{ss})@a(sa(ssas)a(siia(iiii))a{sa{ss}})@a(sssba{ss}a{sa{ss}}))",
+                  &magic, &version, &printers, &models, &option_sets);
+    if (strcmp(magic, BACKEND_CACHE_MAGIC) != 0 || version != BACKEND_CACHE_VERSION)
+    {
+        logwarn("Ignoring cache %s of an unknown format\n", path);
+        goto out;
+    }
+
+    if (b->printer_snapshot == NULL && g_variant_n_children(printers) > 0)
+    {
+        b->printer_snapshot = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                    (GDestroyNotify)free_string,
+                                                    (GDestroyNotify)unref_PrinterEntry);
+        g_variant_iter_init(&iter, printers);
+        while ((child = g_variant_iter_next_value(&iter)))
+        {
+            PrinterEntry *e = unpack_cached_PrinterEntry(child);
+            g_hash_table_insert(b->printer_snapshot, g_strdup(e->name), e);
+            g_variant_unref(child);
+        }
+        logdebug("Loaded %u cached printers\n", g_hash_table_size(b->printer_snapshot));
+    }
+
+    g_variant_iter_init(&iter, models);
+    while ((child = g_variant_iter_next_value(&iter)))
+    {
+        const char *model_key;
+        GVariant *options, *media, *translations;
+        PrinterCapabilities *caps;
+
+        g_variant_get(child, "(&s@a(ssas)@a(siia(iiii))@a{sa{ss}})",
+                      &model_key, &options, &media, &translations);
+        caps = unpack_cached_capabilities(options, media);
+        caps->model_key = g_strdup(model_key);
+        caps->translations = unpack_cached_translations(translations);
+        g_hash_table_replace(b->models, g_strdup(model_key), caps);
+        g_variant_unref(translations);
+        g_variant_unref(options);
+        g_variant_unref(media);
+        g_variant_unref(child);
+    }
+
+    g_variant_iter_init(&iter, option_sets);
+    while ((child = g_variant_iter_next_value(&iter)))
+    {
+        const char *name, *stamp, *model_key, *option_name, *def;
+        GVariant *defaults, *translations;
+        GVariantIter diter;
+        gboolean own_translations;
+        PrinterCapabilities *model, *caps;
+
+        g_variant_get(child, "(&s&s&sb@a{ss}@a{sa{ss}})", &name, &stamp, &model_key,
+                      &own_translations, &defaults, &translations);
+        model = g_hash_table_lookup(b->models, model_key);
+        /** Without a config change time nothing tells whether the queue
+         * was modified while the backend was not running **/
+        if (stamp[0] == '\0')
+            unstamped++;
+        else if (model)
+        {
+            caps = new_queue_capabilities(model, stamp);
+            caps->own_translations = own_translations;
+            caps->translations = unpack_cached_translations(translations);
+            g_variant_iter_init(&diter, defaults);
+            while (g_variant_iter_next(&diter, "{&s&s}", &option_name, &def))
+                for (int i = 0; i < model->num_options; i++)
+                    if (strcmp(model->options[i].option_name, option_name) == 0)
+                        set_queue_default(caps, i, def);
+            g_hash_table_replace(b->capabilities, g_strdup(name), caps);
+        }
+        g_variant_unref(defaults);
+        g_variant_unref(translations);
+        g_variant_unref(child);
+    }
+    prune_model_capabilities(b);
+    logdebug("Loaded %u cached option sets of %u models\n",
+             g_hash_table_size(b->capabilities), g_hash_table_size(b->models));
+    /** cupsd reports the config change time with the attributes the
+     * saved sets are built from, so none should come back without it **/
+    if (unstamped > 0)
+        logwarn("Dropped %u of %" G_GSIZE_FORMAT " cached option sets without a config change time\n",
+                unstamped, g_variant_n_children(option_sets));
+
+out:
+    g_variant_unref(printers);
+    g_variant_unref(models);
+    g_variant_unref(option_sets);
+    g_variant_unref(cache);
+    g_free(path);
+
+    /** The printers may have changed while the backend was not running **/
+    revalidate_printer_snapshot(b);
+}
+
+static GVariant *pack_cached_PrinterEntry(PrinterEntry *e)
+{
+    GVariantBuilder opts;
+    int i;
+
+    g_variant_builder_init(&opts, G_VARIANT_TYPE("a{ss}"));
+    for (i = 0; i < e->dest->num_options; i++)
+        g_variant_builder_add(&opts, "{ss}", e->dest->options[i].name,
+                              e->dest->options[i].value);
+
+    return g_variant_new("(ssssbbba{ss})", e->name, e->dest->name,
+                         e->dest->instance ? e->dest->instance : "",
+                         e->config_stamp ? e->config_stamp : "",
+                         e->dest->is_default, e->is_temporary, e->is_remote, &opts);
+}
+
+static GVariant *pack_cached_translations(GHashTable *table)
+{
+    GVariantBuilder translations;
+    GHashTableIter iter;
+    gpointer locale, dict;
+
+    g_variant_builder_init(&translations, G_VARIANT_TYPE("a{sa{ss}}"));
+    if (table)
+    {
+        g_hash_table_iter_init(&iter, table);
+        while (g_hash_table_iter_next(&iter, &locale, &dict))
+            g_variant_builder_add(&translations, "{s@a{ss}}", locale, dict);
+    }
+    return g_variant_builder_end(&translations);
+}
+
+static GVariant *pack_cached_capabilities(PrinterCapabilities *caps)
+{
+    GVariantBuilder options, media, values;
+    int i, j;
 
-    // Allocate dynamic memory for the buffer within the thread
-    char *buffer = g_malloc(1024);
+    g_variant_builder_init(&options, G_VARIANT_TYPE("a(ssas)"));
+    for (i = 0; i < caps->num_options; i++)
+    {
+        Option *opt = &caps->options[i];
+        g_variant_builder_init(&values, G_VARIANT_TYPE("as"));
+        for (j = 0; j < opt->num_supported; j++)
+            g_variant_builder_add(&values, "s", opt->supported_values[j]);
+        g_variant_builder_add(&options, "(ssas)", opt->option_name,
+                              opt->default_value ? opt->default_value : "NA", &values);
+    }
 
-    // Accept incoming connections
-    int client_fd = accept(thread_data->socket_fd, NULL, NULL);
-    if (client_fd == -1) {
-        perror("Error accepting connection");
-        close(thread_data->socket_fd);
+    g_variant_builder_init(&media, G_VARIANT_TYPE("a(siia(iiii))"));
+    for (i = 0; i < caps->num_media; i++)
+    {
+        Media *m = &caps->media[i];
+        g_variant_builder_add(&media, "(sii@a(iiii))", m->name, m->width, m->length,
+                              pack_margins(m));
     }
 
-    // Placeholder logic for reading data from the socket
-    ssize_t bytesRead;
-    while ((bytesRead = read(client_fd, buffer, 1024)) > 0) {
-        // Send data to CUPS using cupsWriteRequestData
-        http_status_t http_status = cupsWriteRequestData(thread_data->printer->http, buffer, bytesRead);
-        if (http_status != HTTP_STATUS_CONTINUE) {
-            logerror("Error writing print data to server.\n");
-            break;
-        }
+    return g_variant_new("(sa(ssas)a(siia(iiii))@a{sa{ss}})", caps->model_key,
+                         &options, &media, pack_cached_translations(caps->translations));
+}
+
+/** The queue's set: its model, the defaults that differ from the model's and
+ * the queue's own translations **/
+static GVariant *pack_cached_queue_capabilities(const char *name, PrinterCapabilities *caps)
+{
+    GVariantBuilder defaults;
+    int i;
+
+    g_variant_builder_init(&defaults, G_VARIANT_TYPE("a{ss}"));
+    for (i = 0; caps->options != caps->model->options && i < caps->num_options; i++)
+        if (caps->options[i].default_value != caps->model->options[i].default_value)
+            g_variant_builder_add(&defaults, "{ss}", caps->options[i].option_name,
+                                  caps->options[i].default_value);
+
+    return g_variant_new("(sssba{ss}@a{sa{ss}})", name, caps->config_stamp,
+                         caps->model->model_key, caps->own_translations, &defaults,
+                         pack_cached_translations(caps->translations));
+}
+
+gboolean save_backend_cache(BackendObj *b)
+{
+    GVariantBuilder printers, models, option_sets;
+    GHashTableIter iter;
+    gpointer key, value;
+    GVariant *cache;
+    GError *error = NULL;
+    char *path, *dir;
+    gboolean ok;
+
+    g_variant_builder_init(&printers, G_VARIANT_TYPE("a(ssssbbba{ss})"));
+    if (b->printer_snapshot)
+    {
+        g_hash_table_iter_init(&iter, b->printer_snapshot);
+        while (g_hash_table_iter_next(&iter, &key, &value))
+            g_variant_builder_add_value(&printers, pack_cached_PrinterEntry(value));
     }
 
-    // Cleanup and free resources
-    close(thread_data->socket_fd);
-    if (cupsFinishDestDocument(thread_data->printer->http, thread_data->printer->dest, thread_data->printer->dinfo) == IPP_STATUS_OK)
-        logdebug("Document send succeeded.\n");
+    /** Every model set is used by a queue set, see prune_model_capabilities() **/
+    g_variant_builder_init(&models, G_VARIANT_TYPE("a(sa(ssas)a(siia(iiii))a{sa{ss}})"));
+    g_hash_table_iter_init(&iter, b->models);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        g_variant_builder_add_value(&models, pack_cached_capabilities(value));
+
+    /** Sets of printers that could not be asked are not worth keeping **/
+    g_variant_builder_init(&option_sets, G_VARIANT_TYPE("a(sssba{ss}a{sa{ss}})"));
+    g_hash_table_iter_init(&iter, b->capabilities);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        if (((PrinterCapabilities *)value)->model)
+            g_variant_builder_add_value(&option_sets, pack_cached_queue_capabilities(key, value));
+
+    cache = g_variant_ref_sink(g_variant_new("(su@a(sssbbba{ss})@a(sa(ssas)a(siia(iiii))a{sa{ss}})@a(sssba{ss}a{sa{ss}}))",
+                                             BACKEND_CACHE_MAGIC, BACKEND_CACHE_VERSION,
+                                             g_variant_builder_end(&printers),
+                                             g_variant_builder_end(&models),
+                                             g_variant_builder_end(&option_sets)));
+
+    path = get_backend_cache_path();
+    dir = g_path_get_dirname(path);
+    g_mkdir_with_parents(dir, 0700);
+
+    /** Written to a temporary file and renamed, a running backend
+     * may still have the old file mapped **/
+    ok = g_file_set_contents(path, g_variant_get_data(cache), g_variant_get_size(cache), &error);
+    if (!ok)
+    {
+        logwarn("Unable to write cache %s: %s\n", path, error->message);
+        g_error_free(error);
+    }
     else
-        logerror("Document send failed: %s\n", cupsLastErrorString());
-    cupsFreeOptions(thread_data->num_options, thread_data->options);
-    g_free(thread_data);
-    g_free(buffer);
+        logdebug("Wrote cache %s\n", path);
 
-    return NULL;
+    g_variant_unref(cache);
+    g_free(dir);
+    g_free(path);
+    return ok;
 }
 
-void printAllJobs(PrinterCUPS *p)
+static gboolean save_backend_cache_timeout(gpointer user_data)
 {
-    ensure_printer_connection(p);
-    cups_job_t *jobs;
-    int num_jobs = cupsGetJobs2(p->http, &jobs, p->name, 1, CUPS_WHICHJOBS_ALL);
-    for (int i = 0; i < num_jobs; i++)
+    BackendObj *b = user_data;
+
+    b->cache_save_source = 0;
+    save_backend_cache(b);
+    return G_SOURCE_REMOVE;
+}
+
+void schedule_backend_cache_save(BackendObj *b)
+{
+    if (b->cache_save_source)
+        return;
+    b->cache_save_source = g_timeout_add_seconds(BACKEND_CACHE_SAVE_DELAY,
+                                                 save_backend_cache_timeout, b);
+}
+
+/*********Printer usage*****************/
+static char *get_printer_usage_path()
+{
+    return g_build_filename(g_get_user_data_dir(), BACKEND_CACHE_DIR,
+                            BACKEND_USAGE_FILE, NULL);
+}
+
+void load_printer_usage(BackendObj *b)
+{
+    char *path = get_printer_usage_path();
+    GError *error = NULL;
+
+    if (!g_key_file_load_from_file(b->usage, path, G_KEY_FILE_NONE, &error))
     {
-        print_job(&jobs[i]);
+        if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            logwarn("Ignoring usage file %s: %s\n", path, error->message);
+        g_error_free(error);
     }
+    g_free(path);
 }
-static void list_group(ppd_file_t *ppd,    /* I - PPD file */
-                       ppd_group_t *group) /* I - Group to show */
+
+gboolean save_printer_usage(BackendObj *b)
 {
-    logdebug("List group %s\n", group->name);
-    /** Now iterate through the options in the particular group*/
-    logdebug("It has %d options.\n", group->num_options);
-    logdebug("Listing all of them ..\n");
-    int i;
-    for (i = 0; i < group->num_options; i++)
+    char *path = get_printer_usage_path();
+    char *dir = g_path_get_dirname(path);
+    GError *error = NULL;
+    gboolean ok;
+
+    g_mkdir_with_parents(dir, 0700);
+    ok = g_key_file_save_to_file(b->usage, path, &error);
+    if (!ok)
     {
-        logdebug("    Option %d : %s\n", i, group->options[i].keyword);
+        logwarn("Unable to write usage file %s: %s\n", path, error->message);
+        g_error_free(error);
     }
+
+    g_free(dir);
+    g_free(path);
+    return ok;
+}
+
+static gboolean save_printer_usage_timeout(gpointer user_data)
+{
+    BackendObj *b = user_data;
+
+    b->usage_save_source = 0;
+    save_printer_usage(b);
+    return G_SOURCE_REMOVE;
+}
+
+void record_printer_use(BackendObj *b, const char *printer_name, gboolean printed)
+{
+    const char *key = (printed ? "prints" : "selections");
+
+    /** A missing key reads as 0 **/
+    g_key_file_set_uint64(b->usage, printer_name, key,
+                          g_key_file_get_uint64(b->usage, printer_name, key, NULL) + 1);
+
+    if (b->usage_save_source == 0)
+        b->usage_save_source = g_timeout_add_seconds(BACKEND_CACHE_SAVE_DELAY,
+                                                     save_printer_usage_timeout, b);
+}
+
+guint get_printer_usage_score(BackendObj *b, const char *printer_name)
+{
+    if (!g_key_file_has_group(b->usage, printer_name))
+        return 0;
+    return USAGE_PRINT_WEIGHT * g_key_file_get_uint64(b->usage, printer_name, "prints", NULL) +
+           g_key_file_get_uint64(b->usage, printer_name, "selections", NULL);
 }
 
+gint compare_printer_usage(gconstpointer a, gconstpointer b, gpointer backend)
+{
+    const char *name_a = *(const char *const *)a;
+    const char *name_b = *(const char *const *)b;
+    guint score_a = get_printer_usage_score(backend, name_a);
+    guint score_b = get_printer_usage_score(backend, name_b);
+
+    if (score_a != score_b)
+        return (score_a > score_b ? -1 : 1);
+    return strcmp(name_a, name_b);
+}
 
 /**********Dialog related funtions ****************/
 Dialog *get_new_Dialog()
 {
     Dialog *d = g_new(Dialog, 1);
-    d->cancel = 0;
+    d->listing = NULL;
     d->hide_remote = FALSE;
     d->hide_temp = FALSE;
     d->keep_alive = FALSE;
+    d->prefetch_cancel = g_cancellable_new();
     d->printers = g_hash_table_new_full(g_str_hash, g_str_equal,
                                         (GDestroyNotify)free_string,
                                         (GDestroyNotify)free_PrinterCUPS);
@@ -1586,6 +3557,13 @@ Dialog *get_new_Dialog()
 void free_Dialog(Dialog *d)
 {
     logdebug("freeing dialog..\n");
+    if (d->listing)
+    {
+        g_atomic_int_set(&d->listing->cancel, 1);
+        unref_StreamListing(d->listing);
+    }
+    g_cancellable_cancel(d->prefetch_cancel);
+    g_object_unref(d->prefetch_cancel);
     g_hash_table_destroy(d->printers);
     free(d);
 }
@@ -1636,6 +3614,12 @@ void cups_get_Resolution(cups_dest_t *dest, int *xres, int *yres)
     *xres = ippGetResolution(attr, 0, yres, units);
 }
 
+void free_cups_dest(cups_dest_t *dest)
+{
+    if (dest)
+        cupsFreeDests(1, dest);
+}
+
 int add_printer_to_ht(void *user_data, unsigned flags, cups_dest_t *dest)
 {
     GHashTable *h = (GHashTable *)user_data;
@@ -1749,7 +3733,7 @@ gboolean cups_is_temporary(cups_dest_t *dest)
 }
 
 char *extractHostFromURI(const char *uri) {
-    const char *host_start, *host_end;
+    const char *host_start, *host_end, *at_pos;
     char *host = NULL;
 
     // Find the start of the host part
@@ -1760,18 +3744,20 @@ char *extractHostFromURI(const char *uri) {
         return NULL;
     }
 
-    // Find the end of the host part
-    const char *slash_pos = strchr(host_start, '/');
-    const char *colon_pos = strchr(host_start, ':');
-
-    if (slash_pos == NULL && colon_pos == NULL) {
-        host_end = host_start + strlen(host_start); // If no "/" or ":", host extends to end of string
-    } else if (slash_pos == NULL) {
-        host_end = colon_pos;
-    } else if (colon_pos == NULL) {
-        host_end = slash_pos;
+    // Skip the user info, if any
+    host_end = host_start + strcspn(host_start, "/?#");
+    at_pos = memchr(host_start, '@', host_end - host_start);
+    if (at_pos != NULL)
+        host_start = at_pos + 1;
+
+    // Find the end of the host part, IPv6 literals are enclosed in brackets
+    if (*host_start == '[') {
+        host_start++;
+        host_end = strchr(host_start, ']');
+        if (host_end == NULL)
+            return NULL;
     } else {
-        host_end = (slash_pos < colon_pos) ? slash_pos : colon_pos;
+        host_end = host_start + strcspn(host_start, ":/?#");
     }
 
     // Allocate memory for the host part
@@ -1782,146 +3768,543 @@ char *extractHostFromURI(const char *uri) {
         host[host_end - host_start] = '\0'; // Null-terminate the string
     }
 
-    fprintf(stderr, "XXX12: URI: %s Host: %s\n", uri, host);
-
     return host;
 }
 
-gboolean checkRemote(const char *uri) {
-    //GET LOCALHOST ADDRESSES
-    char hostname[1024];
+/**
+ * Addresses and host names under which the local machine is known.
+ * Classifying a printer only looks it up here, so it never waits for
+ * name resolution. The set is rebuilt when the network changes.
+ */
+static GHashTable *local_addresses = NULL;
+G_LOCK_DEFINE_STATIC(local_addresses);
 
-    // Get the hostname of the local machine
-    if (gethostname(hostname, sizeof(hostname)) == -1) {
-        perror("gethostname");
-        return 1;
+/** Bring an IP address literal into its canonical string form **/
+static gboolean canonical_ip_address(const char *host, char *buf, size_t buflen)
+{
+    struct in_addr addr4;
+    struct in6_addr addr6;
+
+    if (inet_pton(AF_INET, host, &addr4) == 1)
+        return (inet_ntop(AF_INET, &addr4, buf, buflen) != NULL);
+
+    if (inet_pton(AF_INET6, host, &addr6) == 1)
+    {
+        /** IPv4-mapped IPv6 addresses are compared as IPv4 **/
+        if (IN6_IS_ADDR_V4MAPPED(&addr6))
+            return (inet_ntop(AF_INET, &addr6.s6_addr[12], buf, buflen) != NULL);
+        return (inet_ntop(AF_INET6, &addr6, buf, buflen) != NULL);
     }
 
-    strcat(hostname, ".local");
+    return FALSE;
+}
+
+static gboolean ip_address_is_loopback(const char *ipstr)
+{
+    return (strncmp(ipstr, "127.", 4) == 0 || strcmp(ipstr, "::1") == 0);
+}
+
+static GHashTable *collect_local_addresses()
+{
+    GHashTable *set = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    struct ifaddrs *ifaddr, *ifa;
+    char hostname[1024];
+    char ipstr[INET6_ADDRSTRLEN];
 
-    // Get the network IP addresses associated with the hostname
-    struct addrinfo hints, *res, *p;
-    int status;
-    int num_addresses = 0;
-    AddressList addresses[MAX_ADDRESSES];
+    g_hash_table_add(set, g_strdup("localhost"));
+    g_hash_table_add(set, g_strdup("localhost.localdomain"));
 
-    // Get the IPv4 addresses associated with the hostname
+    if (gethostname(hostname, sizeof(hostname)) == 0)
     {
+        char *name;
+        hostname[sizeof(hostname) - 1] = '\0';
+        name = g_ascii_strdown(hostname, -1);
+        g_hash_table_add(set, g_strdup_printf("%s.local", name));
+        g_hash_table_add(set, name);
+    }
+    else
+        logwarn("Unable to get the local host name\n");
 
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = AF_INET; // IPv4
-        hints.ai_socktype = SOCK_STREAM;
+    if (getifaddrs(&ifaddr) == -1)
+    {
+        logwarn("Unable to get the local interface addresses\n");
+        return set;
+    }
 
-        if ((status = getaddrinfo(hostname, NULL, &hints, &res)) != 0) {
-            fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
-            return 1;
-        }
+    for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
+    {
+        const void *addr;
 
-        // Iterate over the linked list of addrinfo structures
-        for (p = res; p != NULL && num_addresses < MAX_ADDRESSES; p = p->ai_next) {
-            inet_ntop(p->ai_family, &((struct sockaddr_in *)p->ai_addr)->sin_addr, addresses[num_addresses].ipstr, sizeof(addresses[num_addresses].ipstr));
-            addresses[num_addresses].family = p->ai_family;
-            num_addresses++;
-        }
+        if (ifa->ifa_addr == NULL)
+            continue;
+        if (ifa->ifa_addr->sa_family == AF_INET)
+            addr = &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+        else if (ifa->ifa_addr->sa_family == AF_INET6)
+            addr = &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+        else
+            continue;
+
+        if (inet_ntop(ifa->ifa_addr->sa_family, addr, ipstr, sizeof(ipstr)))
+            g_hash_table_add(set, g_strdup(ipstr));
+    }
+    freeifaddrs(ifaddr);
+
+    logdebug("Collected %u local addresses\n", g_hash_table_size(set));
+    return set;
+}
+
+static gboolean is_local_address(const char *ipstr)
+{
+    gboolean found;
+
+    if (ip_address_is_loopback(ipstr))
+        return TRUE;
+
+    G_LOCK(local_addresses);
+    if (local_addresses == NULL)
+        local_addresses = collect_local_addresses();
+    found = g_hash_table_contains(local_addresses, ipstr);
+    G_UNLOCK(local_addresses);
+    return found;
+}
+
+static gboolean is_local_host_name(const char *name)
+{
+    gboolean found;
+
+    G_LOCK(local_addresses);
+    if (local_addresses == NULL)
+        local_addresses = collect_local_addresses();
+    found = g_hash_table_contains(local_addresses, name);
+    G_UNLOCK(local_addresses);
+    return found;
+}
+
+/**
+ * Host names which are not names of the local machine are resolved in
+ * the background and the addresses are kept for a while, so that
+ * classifying a printer never waits for the resolver.
+ */
+typedef struct _HostResolution
+{
+    /** canonical address strings, empty if the name did not resolve **/
+    GPtrArray *addresses;
+    /** monotonic time after which the result is stale **/
+    gint64 expires;
+    gboolean pending;
+} HostResolution;
+
+static GHashTable *host_cache = NULL;
+G_LOCK_DEFINE_STATIC(host_cache);
+
+/** DNS-SD service URI --> ServiceResolution*, see lookup_service_cache() **/
+static GHashTable *service_cache = NULL;
+G_LOCK_DEFINE_STATIC(service_cache);
+
+static HostResolvedFunc host_resolved_func = NULL;
+static gpointer host_resolved_data = NULL;
+
+static void free_HostResolution(HostResolution *r)
+{
+    if (r->addresses)
+        g_ptr_array_unref(r->addresses);
+    g_free(r);
+}
+
+void set_host_resolved_callback(HostResolvedFunc func, gpointer user_data)
+{
+    host_resolved_func = func;
+    host_resolved_data = user_data;
+}
+
+static void host_resolved_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    char *host = user_data;
+    GError *error = NULL;
+    GList *addresses, *l;
+    HostResolution *r;
+    char ipstr[INET6_ADDRSTRLEN];
+    gint64 ttl;
 
-        freeaddrinfo(res); // Free the linked list
+    addresses = g_resolver_lookup_by_name_finish(G_RESOLVER(source_object), res, &error);
+    if (error)
+    {
+        logdebug("Unable to resolve %s: %s\n", host, error->message);
+        g_error_free(error);
     }
 
-    // Get the IPv6 addresses associated with the hostname
+    G_LOCK(host_cache);
+    r = g_hash_table_lookup(host_cache, host);
+    if (r == NULL)
+    {
+        r = g_new0(HostResolution, 1);
+        g_hash_table_insert(host_cache, g_strdup(host), r);
+    }
+    if (r->addresses)
+        g_ptr_array_unref(r->addresses);
+    r->addresses = g_ptr_array_new_with_free_func(g_free);
+    for (l = addresses; l != NULL; l = l->next)
     {
+        char *addr = g_inet_address_to_string(l->data);
+        if (canonical_ip_address(addr, ipstr, sizeof(ipstr)))
+            g_ptr_array_add(r->addresses, g_strdup(ipstr));
+        g_free(addr);
+    }
+    ttl = (r->addresses->len > 0 ? HOST_CACHE_TTL : HOST_CACHE_NEGATIVE_TTL);
+    r->expires = g_get_monotonic_time() + ttl * G_USEC_PER_SEC;
+    r->pending = FALSE;
+    G_UNLOCK(host_cache);
 
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = AF_INET6; // IPv6
-        hints.ai_socktype = SOCK_STREAM;
+    if (addresses)
+        g_resolver_free_addresses(addresses);
 
-        if ((status = getaddrinfo(hostname, NULL, &hints, &res)) != 0) {
-            fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
-            return 1;
-        }
+    if (host_resolved_func)
+        host_resolved_func(host, host_resolved_data);
+    g_free(host);
+}
 
-        // Iterate over the linked list of addrinfo structures
-        for (p = res; p != NULL && num_addresses < MAX_ADDRESSES; p = p->ai_next) {
-            inet_ntop(p->ai_family, &((struct sockaddr_in6 *)p->ai_addr)->sin6_addr, addresses[num_addresses].ipstr, sizeof(addresses[num_addresses].ipstr));
-            addresses[num_addresses].family = p->ai_family;
-            num_addresses++;
-        }
+/** Runs on the main context, which completes the asynchronous lookup **/
+static gboolean start_host_lookup(gpointer user_data)
+{
+    char *host = user_data;
+    GResolver *resolver = g_resolver_get_default();
+
+    /** The lookup keeps its own reference to the resolver **/
+    logdebug("Resolving %s\n", host);
+    g_resolver_lookup_by_name_async(resolver, host, NULL,
+                                    host_resolved_cb, g_strdup(host));
+    g_object_unref(resolver);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean same_address_set(GHashTable *a, GHashTable *b)
+{
+    GHashTableIter iter;
+    gpointer key;
+
+    if (a == NULL || b == NULL || g_hash_table_size(a) != g_hash_table_size(b))
+        return FALSE;
+    g_hash_table_iter_init(&iter, a);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+        if (!g_hash_table_contains(b, key))
+            return FALSE;
+    return TRUE;
+}
+
+gboolean refresh_local_addresses()
+{
+    GHashTable *set = collect_local_addresses();
 
-        freeaddrinfo(res); // Free the linked list
+    G_LOCK(local_addresses);
+    if (same_address_set(local_addresses, set))
+    {
+        G_UNLOCK(local_addresses);
+        g_hash_table_unref(set);
+        return FALSE;
     }
+    if (local_addresses)
+        g_hash_table_unref(local_addresses);
+    local_addresses = set;
+    G_UNLOCK(local_addresses);
+
+    G_LOCK(host_cache);
+    if (host_cache)
+        g_hash_table_remove_all(host_cache);
+    G_UNLOCK(host_cache);
+
+    G_LOCK(service_cache);
+    if (service_cache)
+        g_hash_table_remove_all(service_cache);
+    G_UNLOCK(service_cache);
+    return TRUE;
+}
 
-    // COMPARE LOCAL IP ADDRESSES WITH THAT OF THE URI
-    struct addrinfo *uri_res;
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+/**
+ * Look the host up in the cache. Returns TRUE and sets *local if the
+ * answer is known, otherwise makes sure a lookup is running and returns FALSE.
+ * A stale entry still answers while it is looked up again.
+ */
+static gboolean lookup_host_cache(const char *host, gboolean *local)
+{
+    HostResolution *r;
+    gboolean known = FALSE, lookup = FALSE;
+    guint i;
+
+    *local = FALSE;
+
+    G_LOCK(host_cache);
+    if (host_cache == NULL)
+        host_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           (GDestroyNotify)free_HostResolution);
+    r = g_hash_table_lookup(host_cache, host);
+    if (r == NULL)
+    {
+        r = g_new0(HostResolution, 1);
+        g_hash_table_insert(host_cache, g_strdup(host), r);
+    }
 
-    const char* new_uri = extractHostFromURI(uri);
+    if (r->addresses)
+    {
+        known = TRUE;
+        for (i = 0; i < r->addresses->len; i++)
+            if (is_local_address(g_ptr_array_index(r->addresses, i)))
+                *local = TRUE;
+    }
 
-    if ((status = getaddrinfo(new_uri, NULL, &hints, &uri_res)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
-        return 1;
+    if (!r->pending && (r->addresses == NULL || g_get_monotonic_time() > r->expires))
+    {
+        r->pending = TRUE;
+        lookup = TRUE;
     }
+    G_UNLOCK(host_cache);
 
+    if (lookup)
+        g_main_context_invoke_full(NULL, G_PRIORITY_DEFAULT,
+                                   start_host_lookup, g_strdup(host), g_free);
+    return known;
+}
 
-    for (p = uri_res; p != NULL; p = p->ai_next) {
-        void *addr;
-        char ipstr[INET6_ADDRSTRLEN];
+/**
+ * DNS-SD service names are resolved to the printer's host on a worker
+ * thread, as that is an mDNS query, and the host is kept for a while
+ * like the addresses of host names.
+ */
+typedef struct _ServiceResolution
+{
+    /** the host of the service, NULL if it did not resolve **/
+    char *host;
+    /** monotonic time after which the result is stale **/
+    gint64 expires;
+    gboolean resolved;
+    gboolean pending;
+} ServiceResolution;
+
+static void free_ServiceResolution(ServiceResolution *r)
+{
+    free(r->host);
+    g_free(r);
+}
 
-        // Get the pointer to the address itself,
-        // different fields in IPv4 and IPv6:
-        if (p->ai_family == AF_INET) { // IPv4
-            struct sockaddr_in *ipv4 = (struct sockaddr_in *)p->ai_addr;
-            addr = &(ipv4->sin_addr);
-        } else { // IPv6
-            struct sockaddr_in6 *ipv6 = (struct sockaddr_in6 *)p->ai_addr;
-            addr = &(ipv6->sin6_addr);
-        }
+/* Runs on a worker thread */
+static void resolve_service_thread(GTask *task, gpointer source_object,
+                                   gpointer task_data, GCancellable *cancellable)
+{
+    char *resolved_uri = cfResolveURI(task_data);
+    char *host = (resolved_uri ? extractHostFromURI(resolved_uri) : NULL);
 
-        // Convert the IP to a string
-        inet_ntop(p->ai_family, addr, ipstr, sizeof(ipstr));
+    free(resolved_uri);
+    g_task_return_pointer(task, host, free);
+}
 
-        // Check if this IP address matches any of the addresses associated with the local hostname
-        for (int i = 0; i < num_addresses; i++) {
-            if (p->ai_family == addresses[i].family && strcmp(ipstr, addresses[i].ipstr) == 0) {
-                return FALSE;
-            }
-        }
+static void service_resolved_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    char *uri = g_task_get_task_data(G_TASK(res));
+    char *host = g_task_propagate_pointer(G_TASK(res), NULL);
+    ServiceResolution *r;
+    gint64 ttl;
+
+    if (host == NULL)
+        logdebug("Unable to resolve %s\n", uri);
+
+    G_LOCK(service_cache);
+    r = g_hash_table_lookup(service_cache, uri);
+    if (r == NULL)
+    {
+        r = g_new0(ServiceResolution, 1);
+        g_hash_table_insert(service_cache, g_strdup(uri), r);
     }
+    free(r->host);
+    r->host = host;
+    ttl = (host ? HOST_CACHE_TTL : HOST_CACHE_NEGATIVE_TTL);
+    r->expires = g_get_monotonic_time() + ttl * G_USEC_PER_SEC;
+    r->resolved = TRUE;
+    r->pending = FALSE;
+    G_UNLOCK(service_cache);
+
+    /** The printers waiting for the service wait for it by its URI **/
+    if (host_resolved_func)
+        host_resolved_func(uri, host_resolved_data);
+}
 
-    freeaddrinfo(uri_res); // Free the linked list
-    return TRUE;
+/** Runs on the main context, which gets the result of the worker **/
+static gboolean start_service_lookup(gpointer user_data)
+{
+    GTask *task = g_task_new(NULL, NULL, service_resolved_cb, NULL);
+
+    logdebug("Resolving %s\n", (char *)user_data);
+    g_task_set_task_data(task, g_strdup(user_data), g_free);
+    g_task_run_in_thread(task, resolve_service_thread);
+    g_object_unref(task);
+    return G_SOURCE_REMOVE;
 }
 
-gboolean cups_is_remote(cups_dest_t *dest)
+/**
+ * Look the DNS-SD service up in the cache. Returns TRUE and sets *host
+ * (free() it, NULL if the service did not resolve) if the answer is known,
+ * otherwise makes sure a lookup is running and returns FALSE.
+ */
+static gboolean lookup_service_cache(const char *uri, char **host)
 {
-    g_assert_nonnull(dest);
-    const char *device_uri = cupsGetOption("device-uri", dest->num_options, dest->options);
+    ServiceResolution *r;
+    gboolean known = FALSE, lookup = FALSE;
 
-    const char *uri = cfResolveURI(device_uri);
+    *host = NULL;
 
-    fprintf(stderr, "XXX10: deviceURI: %s \n", device_uri);
-    fprintf(stderr, "XXX11: cfURI: %s \n", uri);
+    G_LOCK(service_cache);
+    if (service_cache == NULL)
+        service_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify)free_ServiceResolution);
+    r = g_hash_table_lookup(service_cache, uri);
+    if (r == NULL)
+    {
+        r = g_new0(ServiceResolution, 1);
+        g_hash_table_insert(service_cache, g_strdup(uri), r);
+    }
 
-    // Check for "localhost"
-    if (strstr(uri, "localhost") != NULL) {
-        return FALSE;
+    if (r->resolved)
+    {
+        known = TRUE;
+        *host = (r->host ? strdup(r->host) : NULL);
     }
-    
-    // Check for "::1"
-    if (strstr(uri, "::1") != NULL) {
-        return FALSE;
+
+    if (!r->pending && (!r->resolved || g_get_monotonic_time() > r->expires))
+    {
+        r->pending = TRUE;
+        lookup = TRUE;
     }
-    
-    // Check for IPv4 IP addresses starting with "127"
-    if (strncmp(uri, "127.", 4) == 0) {
-        return FALSE;
+    G_UNLOCK(service_cache);
+
+    if (lookup)
+        g_main_context_invoke_full(NULL, G_PRIORITY_DEFAULT,
+                                   start_service_lookup, g_strdup(uri), g_free);
+    return known;
+}
+
+static gboolean is_local_host(const char *host, gboolean *provisional)
+{
+    char ipstr[INET6_ADDRSTRLEN];
+    char *name;
+    size_t len;
+    gboolean local;
+
+    *provisional = FALSE;
+    if (canonical_ip_address(host, ipstr, sizeof(ipstr)))
+        return is_local_address(ipstr);
+
+    /** Host names are compared case-insensitively, without the root dot **/
+    name = g_ascii_strdown(host, -1);
+    len = strlen(name);
+    if (len > 0 && name[len - 1] == '.')
+        name[len - 1] = '\0';
+
+    if (is_local_host_name(name))
+        local = TRUE;
+    else
+        *provisional = !lookup_host_cache(name, &local);
+
+    g_free(name);
+    return local;
+}
+
+/** Classify the host, taking it; returns it if it is still being resolved **/
+static char *classify_host(char *host, gboolean *remote)
+{
+    gboolean provisional;
+
+    *remote = !is_local_host(host, &provisional);
+    if (!provisional) {
+        free(host);
+        return NULL;
+    }
+    return host;
+}
+
+static gboolean is_dnssd_uri(const char *uri)
+{
+    return strncmp(uri, "dnssd://", 8) == 0 || strstr(uri, "._tcp") != NULL;
+}
+
+/**
+ * Classify a DNS-SD printer by the host of its service. Until that is
+ * known the printer counts as remote, as when the service can not be
+ * resolved; the URI is returned then, to be waited for.
+ */
+static char *classify_service(const char *uri, gboolean *remote)
+{
+    char *host;
+
+    if (!lookup_service_cache(uri, &host)) {
+        *remote = TRUE;
+        logdebug("URI %s is remote until its service is resolved\n", uri);
+        return strdup(uri);
+    }
+    if (host == NULL) {
+        *remote = TRUE;
+        return NULL;
+    }
+    return classify_host(host, remote);
+}
+
+char *classify_pending_host(const char *pending_host, gboolean *remote)
+{
+    if (is_dnssd_uri(pending_host))
+        return classify_service(pending_host, remote);
+    return classify_host(strdup(pending_host), remote);
+}
+
+char *uri_remote_host(const char *uri, gboolean *remote)
+{
+    char *host = extractHostFromURI(uri);
+    char *pending_host;
+
+    /** URIs without a network host, like "hp:/usb/...", are local devices **/
+    if (host == NULL || host[0] == '\0') {
+        free(host);
+        *remote = FALSE;
+        return NULL;
     }
 
+    pending_host = classify_host(host, remote);
+    logdebug("URI %s is %s%s\n", uri, *remote ? "remote" : "local",
+             pending_host ? " until its host is resolved" : "");
+    return pending_host;
+}
+
+gboolean checkRemote(const char *uri) {
+    gboolean remote;
+    free(uri_remote_host(uri, &remote));
+    return remote;
+}
+
+char *cups_classify_remote(cups_dest_t *dest, gboolean *remote)
+{
+    g_assert_nonnull(dest);
+    const char *device_uri = cupsGetOption("device-uri", dest->num_options, dest->options);
+
+    *remote = FALSE;
+
+    /** Nothing to compare against without a device URI **/
+    if (device_uri == NULL)
+        return NULL;
+
     // Check if the URI starts with "usb://" or "parallel://"
-    if (strncmp(uri, "usb://", 6) == 0 || strncmp(uri, "parallel://", 11) == 0) {
-        return FALSE;
+    if (strncmp(device_uri, "usb://", 6) == 0 || strncmp(device_uri, "parallel://", 11) == 0) {
+        return NULL;
     }
 
-    return checkRemote(uri);
+    /** Only DNS-SD service names need to be resolved to get at the host,
+     * which is done in the background **/
+    if (is_dnssd_uri(device_uri))
+        return classify_service(device_uri, remote);
+
+    return uri_remote_host(device_uri, remote);
+}
+
+gboolean cups_is_remote(cups_dest_t *dest)
+{
+    gboolean remote;
+    free(cups_classify_remote(dest, &remote));
+    return remote;
 }
 
 char *extract_ipp_attribute(ipp_attribute_t *attr, int index, const char *option_name)
@@ -2000,111 +4383,635 @@ void print_job(cups_job_t *j)
     logdebug("state : %s\n", state);
 }
 
-char *get_option_translation(PrinterCUPS *p,
-                             const char *option_name,
-                             const char *locale)
+/**
+ * A libcupsfilters catalog compiled to a flat table, which is looked up
+ * in place without parsing or allocating:
+ *
+ *   CatalogHeader
+ *   CatalogEntry entries[num_entries]   sorted by bucket, then key
+ *   guint32 buckets[num_buckets + 1]    index of the first entry of each bucket
+ *   char strings[]                      NUL-terminated, each stored once
+ *
+ * Option names are keys of their own, choices are "option\tchoice".
+ * The file is in host byte order; it is only ever read on the machine
+ * that wrote it.
+ */
+typedef struct _CatalogHeader
 {
-    char *copy;
-    const char *uri, *translation;
-    static const char *const req_attrs[] = {"printer-strings-uri"};
-    ipp_attribute_t *attr;
-    ipp_t *request, *response;
-    cups_array_t *opts_catalog, *printer_opts_catalog;
+    char magic[8];
+    guint32 version;
+    guint32 num_entries;
+    guint32 num_buckets;
+    guint32 strings_offset;
+    /** the catalog file it was compiled from, to notice updates **/
+    gint64 source_mtime;
+    gint64 source_size;
+} CatalogHeader;
+
+typedef struct _CatalogEntry
+{
+    guint32 hash;
+    guint32 key;       /** offsets into the strings **/
+    guint32 value;
+} CatalogEntry;
 
-    ensure_printer_connection(p);
-    request = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
-    uri = cupsGetOption("printer-uri-supported", 
-                        p->dest->num_options,
-                        p->dest->options);
-    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
-                    "printer-uri", NULL, uri);
-    ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
-                    "requested-attributes", 1, NULL, req_attrs);
-    response = cupsDoRequest(p->http, request, "/");
-    if (cupsLastError() >= IPP_STATUS_ERROR_BAD_REQUEST)
+typedef struct _CompiledCatalog
+{
+    /** keeps the mapping (or the in-memory table) alive **/
+    GBytes *bytes;
+    const CatalogHeader *header;
+    const CatalogEntry *entries;
+    const guint32 *buckets;
+    const char *strings;
+} CompiledCatalog;
+
+/** FNV-1a, which unlike g_str_hash() is part of the file format **/
+static guint32 catalog_hash(guint32 hash, const char *str)
+{
+    for (; *str; str++)
+        hash = (hash ^ (guchar)*str) * 16777619u;
+    return hash;
+}
+
+static guint32 catalog_key_hash(const char *option_name, const char *choice_name)
+{
+    guint32 hash = catalog_hash(2166136261u, option_name);
+    if (choice_name)
+        hash = catalog_hash(catalog_hash(hash, "\t"), choice_name);
+    return hash;
+}
+
+typedef struct _CatalogSourceEntry
+{
+    guint32 hash;
+    guint32 bucket;
+    char *key;
+    const char *value;
+} CatalogSourceEntry;
+
+static int compare_catalog_source_entries(const void *a, const void *b)
+{
+    const CatalogSourceEntry *x = a, *y = b;
+
+    if (x->bucket != y->bucket)
+        return (x->bucket < y->bucket ? -1 : 1);
+    return strcmp(x->key, y->key);
+}
+
+static guint32 intern_catalog_string(GByteArray *strings, GHashTable *offsets, const char *str)
+{
+    gpointer offset;
+
+    if (g_hash_table_lookup_extended(offsets, str, NULL, &offset))
+        return GPOINTER_TO_UINT(offset);
+
+    guint32 new_offset = strings->len;
+    g_byte_array_append(strings, (const guint8 *)str, strlen(str) + 1);
+    g_hash_table_insert(offsets, (gpointer)str, GUINT_TO_POINTER(new_offset));
+    return new_offset;
+}
+
+/** Parse the text catalog for the locale and flatten it **/
+static GBytes *compile_catalog(const char *locale, gint64 source_mtime, gint64 source_size)
+{
+    cups_array_t *catalog = cfCatalogOptionArrayNew();
+    cf_catalog_opt_strings_t *opt;
+    cf_catalog_choice_strings_t *choice;
+    GArray *source = g_array_new(FALSE, FALSE, sizeof(CatalogSourceEntry));
+    GByteArray *table = g_byte_array_new();
+    GByteArray *strings = g_byte_array_new();
+    GHashTable *offsets = g_hash_table_new(g_str_hash, g_str_equal);
+    CatalogSourceEntry se;
+    CatalogHeader header;
+    guint32 num_buckets, *buckets, i;
+
+    cfCatalogLoad(NULL, locale, catalog);
+    for (opt = cupsArrayFirst(catalog); opt; opt = cupsArrayNext(catalog))
     {
-        /* request failed */
-        logerror("Request failed: %s\n", cupsLastErrorString());
-        return g_strdup(option_name);
+        if (opt->name == NULL)
+            continue;
+        if (opt->human_readable)
+        {
+            se.hash = catalog_key_hash(opt->name, NULL);
+            se.key = g_strdup(opt->name);
+            se.value = opt->human_readable;
+            g_array_append_val(source, se);
+        }
+        for (choice = cupsArrayFirst(opt->choices); choice; choice = cupsArrayNext(opt->choices))
+        {
+            if (choice->name == NULL || choice->human_readable == NULL)
+                continue;
+            se.hash = catalog_key_hash(opt->name, choice->name);
+            se.key = g_strconcat(opt->name, "\t", choice->name, NULL);
+            se.value = choice->human_readable;
+            g_array_append_val(source, se);
+        }
     }
 
-    opts_catalog = cfCatalogOptionArrayNew();
-    cfCatalogLoad(NULL, locale, opts_catalog);
-    if ((attr = ippFindAttribute(response, "printer-strings-uri",
-                                    IPP_TAG_URI)) != NULL)
+    num_buckets = MAX(source->len, 1);
+    for (i = 0; i < source->len; i++)
+        g_array_index(source, CatalogSourceEntry, i).bucket =
+            g_array_index(source, CatalogSourceEntry, i).hash % num_buckets;
+    qsort(source->data, source->len, sizeof(CatalogSourceEntry), compare_catalog_source_entries);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COMPILED_CATALOG_MAGIC, sizeof(COMPILED_CATALOG_MAGIC));
+    header.version = COMPILED_CATALOG_VERSION;
+    header.num_entries = source->len;
+    header.num_buckets = num_buckets;
+    header.strings_offset = sizeof(CatalogHeader) + sizeof(CatalogEntry) * source->len +
+                            sizeof(guint32) * (num_buckets + 1);
+    header.source_mtime = source_mtime;
+    header.source_size = source_size;
+    g_byte_array_append(table, (const guint8 *)&header, sizeof(header));
+
+    buckets = g_new0(guint32, num_buckets + 1);
+    for (i = 0; i < source->len; i++)
     {
-        printer_opts_catalog = cfCatalogOptionArrayNew();
-        cfCatalogLoad(ippGetString(attr, 0, NULL), NULL, printer_opts_catalog);
+        CatalogSourceEntry *s = &g_array_index(source, CatalogSourceEntry, i);
+        CatalogEntry e = {s->hash,
+                          intern_catalog_string(strings, offsets, s->key),
+                          intern_catalog_string(strings, offsets, s->value)};
+        g_byte_array_append(table, (const guint8 *)&e, sizeof(e));
+        buckets[s->bucket + 1] = i + 1;
     }
+    /** Empty buckets start where the one before ends **/
+    for (i = 1; i <= num_buckets; i++)
+        buckets[i] = MAX(buckets[i], buckets[i - 1]);
+    g_byte_array_append(table, (const guint8 *)buckets, sizeof(guint32) * (num_buckets + 1));
+    g_byte_array_append(table, strings->data, strings->len);
+
+    logdebug("Compiled the option catalog for locale '%s': %u strings\n",
+             locale ? locale : "", source->len);
+
+    for (i = 0; i < source->len; i++)
+        g_free(g_array_index(source, CatalogSourceEntry, i).key);
+    g_free(buckets);
+    g_hash_table_destroy(offsets);
+    g_byte_array_free(strings, TRUE);
+    g_array_free(source, TRUE);
+    cupsArrayDelete(catalog);
+    return g_byte_array_free_to_bytes(table);
+}
 
-    translation = cfCatalogLookUpOption((char *)option_name, 
-                                        opts_catalog, printer_opts_catalog);
-    copy = g_strdup(translation);
-    cupsArrayDelete(opts_catalog);
-    cupsArrayDelete(printer_opts_catalog);
-    return copy;
+/** Check the table is complete and everything in it points inside it **/
+static gboolean open_compiled_catalog(CompiledCatalog *cat, GBytes *bytes,
+                                      gint64 source_mtime, gint64 source_size)
+{
+    gsize size;
+    const char *data = g_bytes_get_data(bytes, &size);
+    const CatalogHeader *header = (const CatalogHeader *)data;
+    gsize strings_size;
+    guint32 i;
+
+    if (size < sizeof(CatalogHeader) ||
+        memcmp(header->magic, COMPILED_CATALOG_MAGIC, sizeof(COMPILED_CATALOG_MAGIC)) != 0 ||
+        header->version != COMPILED_CATALOG_VERSION ||
+        header->source_mtime != source_mtime || header->source_size != source_size ||
+        header->num_buckets == 0 || header->num_entries > size / sizeof(CatalogEntry) ||
+        header->num_buckets > size / sizeof(guint32) ||
+        header->strings_offset != sizeof(CatalogHeader) +
+                                  sizeof(CatalogEntry) * (gsize)header->num_entries +
+                                  sizeof(guint32) * ((gsize)header->num_buckets + 1) ||
+        header->strings_offset > size)
+        return FALSE;
+
+    cat->header = header;
+    cat->entries = (const CatalogEntry *)(data + sizeof(CatalogHeader));
+    cat->buckets = (const guint32 *)(cat->entries + header->num_entries);
+    cat->strings = data + header->strings_offset;
+    strings_size = size - header->strings_offset;
+
+    if (header->num_entries > 0 && (strings_size == 0 || cat->strings[strings_size - 1] != '\0'))
+        return FALSE;
+    for (i = 0; i < header->num_entries; i++)
+        if (cat->entries[i].key >= strings_size || cat->entries[i].value >= strings_size)
+            return FALSE;
+    for (i = 0; i < header->num_buckets; i++)
+        if (cat->buckets[i] > cat->buckets[i + 1] || cat->buckets[i + 1] > header->num_entries)
+            return FALSE;
+
+    cat->bytes = g_bytes_ref(bytes);
+    return TRUE;
 }
 
-char *get_choice_translation(PrinterCUPS *p,
-                             const char *option_name,
-                             const char *choice_name,
-                             const char *locale)
+/** The translation of the option, or of its choice if choice_name is set **/
+static const char *compiled_catalog_lookup(const CompiledCatalog *cat,
+                                           const char *option_name,
+                                           const char *choice_name)
+{
+    guint32 hash = catalog_key_hash(option_name, choice_name);
+    guint32 bucket = hash % cat->header->num_buckets;
+    gsize len = strlen(option_name);
+
+    for (guint32 i = cat->buckets[bucket]; i < cat->buckets[bucket + 1]; i++)
+    {
+        const CatalogEntry *e = &cat->entries[i];
+        const char *key = cat->strings + e->key;
+
+        if (e->hash != hash || strncmp(key, option_name, len) != 0)
+            continue;
+        if (choice_name == NULL ? key[len] == '\0'
+                                : (key[len] == '\t' && strcmp(key + len + 1, choice_name) == 0))
+            return cat->strings + e->value;
+    }
+    return NULL;
+}
+
+static char *get_compiled_catalog_path(const char *locale)
+{
+    const char *dir = g_getenv("CPDB_CUPS_CATALOG_CACHE_DIR");
+    char *name = g_strdup_printf("%s.cat", (locale && locale[0]) ? locale : "default");
+    char *path;
+
+    if (dir && dir[0])
+        path = g_build_filename(dir, name, NULL);
+    else
+        path = g_build_filename(g_get_user_cache_dir(), BACKEND_CACHE_DIR,
+                                COMPILED_CATALOG_DIR, name, NULL);
+    g_free(name);
+    return path;
+}
+
+/** Map the compiled catalog for the locale, compiling it first if it is missing or outdated **/
+static CompiledCatalog *load_compiled_catalog(const char *locale)
+{
+    CompiledCatalog *cat = g_new0(CompiledCatalog, 1);
+    char *source = cfCatalogFind(NULL, locale);
+    char *path = get_compiled_catalog_path(locale);
+    char *dir;
+    gint64 source_mtime = 0, source_size = 0;
+    GMappedFile *file;
+    GBytes *bytes = NULL;
+    GError *error = NULL;
+    GStatBuf st;
+
+    if (source && g_stat(source, &st) == 0)
+    {
+        source_mtime = st.st_mtime;
+        source_size = st.st_size;
+    }
+
+    if ((file = g_mapped_file_new(path, FALSE, NULL)) != NULL)
+    {
+        bytes = g_mapped_file_get_bytes(file);
+        g_mapped_file_unref(file);
+        if (open_compiled_catalog(cat, bytes, source_mtime, source_size))
+        {
+            logdebug("Mapped the compiled option catalog %s\n", path);
+            goto out;
+        }
+        logdebug("Compiled option catalog %s is outdated\n", path);
+        g_bytes_unref(bytes);
+    }
+
+    bytes = compile_catalog(locale, source_mtime, source_size);
+
+    /** Other backends may have the old file mapped, it is replaced by a rename **/
+    dir = g_path_get_dirname(path);
+    g_mkdir_with_parents(dir, 0755);
+    g_free(dir);
+    if (g_file_set_contents(path, g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes), &error) &&
+        (file = g_mapped_file_new(path, FALSE, NULL)) != NULL)
+    {
+        g_bytes_unref(bytes);
+        bytes = g_mapped_file_get_bytes(file);
+        g_mapped_file_unref(file);
+    }
+    else if (error)
+    {
+        logwarn("Unable to write %s, using the catalog from memory: %s\n", path, error->message);
+        g_error_free(error);
+    }
+
+    /** Can only fail if the file changed under us; no translations then **/
+    if (!open_compiled_catalog(cat, bytes, source_mtime, source_size))
+    {
+        logwarn("Unable to use the compiled option catalog %s\n", path);
+        memset(cat, 0, sizeof(*cat));
+    }
+
+out:
+    g_bytes_unref(bytes);
+    free(source);
+    g_free(path);
+    return cat;
+}
+
+/**
+ * The compiled catalog for each locale asked for, mapped once and kept
+ * for the life of the backend; maps locale ("" for the default) to
+ * CompiledCatalog*
+ */
+G_LOCK_DEFINE_STATIC(locale_catalogs);
+static GHashTable *locale_catalogs;
+
+static const CompiledCatalog *get_locale_catalog(const char *locale)
+{
+    CompiledCatalog *catalog;
+
+    G_LOCK(locale_catalogs);
+    if (locale_catalogs == NULL)
+        locale_catalogs = g_hash_table_new(g_str_hash, g_str_equal);
+
+    catalog = g_hash_table_lookup(locale_catalogs, locale ? locale : "");
+    if (catalog == NULL)
+    {
+        catalog = load_compiled_catalog(locale);
+        g_hash_table_insert(locale_catalogs, g_strdup(locale ? locale : ""), catalog);
+    }
+    G_UNLOCK(locale_catalogs);
+
+    return catalog;
+}
+
+/** Group translations by "locale\ngroup", NULL values for groups without one **/
+G_LOCK_DEFINE_STATIC(group_translations);
+static GHashTable *group_translations;
+
+char *get_group_translation(const char *group_name, const char *locale)
+{
+    char *key = g_strdup_printf("%s\n%s", locale ? locale : "", group_name);
+    gpointer translation;
+
+    G_LOCK(group_translations);
+    if (group_translations == NULL)
+        group_translations = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free);
+
+    if (!g_hash_table_lookup_extended(group_translations, key, NULL, &translation))
+    {
+        translation = cpdbGetGroupTranslation2(group_name, locale);
+        g_hash_table_insert(group_translations, key, translation);
+        key = NULL;
+    }
+    translation = g_strdup(translation);
+    G_UNLOCK(group_translations);
+
+    g_free(key);
+    return translation;
+}
+
+/**
+ * The strings file of a printer for a locale, downloaded once and then
+ * only revalidated with If-Modified-Since
+ */
+typedef struct _PrinterStrings
+{
+    /** NULL if the printer has none, which is remembered as well **/
+    char *uri;
+    /** parsed strings, NULL if the printer has none or the download failed **/
+    cups_array_t *catalog;
+    /** Last-Modified of the downloaded file, NULL if not sent **/
+    char *last_modified;
+    /** tells downloads apart: Last-Modified, or the time of the download
+     * if that was not sent; NULL before the first download **/
+    char *version;
+    /** monotonic time of the last download or revalidation, 0 to revalidate **/
+    gint64 checked;
+} PrinterStrings;
+
+static void free_PrinterStrings(PrinterStrings *ps)
 {
-    char *copy;
-    const char *uri, *translation;
-    static const char *const req_attrs[] = {"printer-strings-uri"};
+    g_free(ps->uri);
+    cupsArrayDelete(ps->catalog);
+    g_free(ps->last_modified);
+    g_free(ps->version);
+    g_free(ps);
+}
+
+/** Used on the main loop only; maps "printer\nlocale" to PrinterStrings* **/
+static GHashTable *printer_strings;
+
+/** The printer-strings-uri for the locale, asked for in that language **/
+static char *get_printer_strings_uri(PrinterCUPS *p, const char *locale)
+{
+    static const char *const requested_attributes[] = {"printer-strings-uri"};
     ipp_attribute_t *attr;
-    ipp_t *request, *response;
-    cups_array_t *opts_catalog, *printer_opts_catalog;
+    ipp_t *response;
+    char *uri = NULL;
+    char lang[32];
+    int i;
+
+    /** The attributes fetched already are in the default language **/
+    if (locale == NULL || locale[0] == '\0')
+    {
+        response = get_printer_attributes(p);
+        if (response && (attr = ippFindAttribute(response, "printer-strings-uri", IPP_TAG_URI)))
+            uri = g_strdup(ippGetString(attr, 0, NULL));
+        return uri;
+    }
+
+    if (!ensure_printer_connection(p))
+        return NULL;
+
+    /** "de_DE.UTF-8" is "de-de" in IPP **/
+    for (i = 0; locale[i] && locale[i] != '.' && locale[i] != '@' && i < sizeof(lang) - 1; i++)
+        lang[i] = (locale[i] == '_' ? '-' : g_ascii_tolower(locale[i]));
+    lang[i] = '\0';
+
+    ipp_t *request = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
+    if ((attr = ippFindAttribute(request, "attributes-natural-language", IPP_TAG_LANGUAGE)))
+        ippSetString(request, &attr, 0, lang);
+    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "printer-uri", NULL,
+                 cupsGetOption("printer-uri-supported", p->dest->num_options, p->dest->options));
+    ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "requested-attributes",
+                  G_N_ELEMENTS(requested_attributes), NULL, requested_attributes);
 
-    ensure_printer_connection(p);
-    request = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
-    uri = cupsGetOption("printer-uri-supported", 
-                        p->dest->num_options,
-                        p->dest->options);
-    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
-                    "printer-uri", NULL, uri);
-    ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
-                    "requested-attributes", 1, NULL, req_attrs);
     response = cupsDoRequest(p->http, request, "/");
-    if (cupsLastError() >= IPP_STATUS_ERROR_BAD_REQUEST)
+    if (response && (attr = ippFindAttribute(response, "printer-strings-uri", IPP_TAG_URI)))
+        uri = g_strdup(ippGetString(attr, 0, NULL));
+    ippDelete(response);
+    return uri;
+}
+
+/** Download the strings file if it changed since the last download **/
+static void revalidate_printer_strings(PrinterStrings *ps)
+{
+    char scheme[32], userpass[256], host[256], resource[1024], tempfile[1024];
+    const char *last_modified;
+    cups_array_t *catalog;
+    http_status_t status;
+    http_t *http;
+    int port, fd;
+
+    ps->checked = g_get_monotonic_time();
+
+    if (httpSeparateURI(HTTP_URI_CODING_ALL, ps->uri, scheme, sizeof(scheme), userpass,
+                        sizeof(userpass), host, sizeof(host), &port, resource,
+                        sizeof(resource)) < HTTP_URI_STATUS_OK)
     {
-        /* request failed */
-        logerror("Request failed: %s\n", cupsLastErrorString());
-        return g_strdup(choice_name);
+        logwarn("Invalid printer-strings-uri %s\n", ps->uri);
+        return;
     }
 
-    opts_catalog = cfCatalogOptionArrayNew();
-    cfCatalogLoad(NULL, locale, opts_catalog);
-    if ((attr = ippFindAttribute(response, "printer-strings-uri",
-                                    IPP_TAG_URI)) != NULL)
+    http = httpConnect2(host, port, NULL, AF_UNSPEC,
+                        (strcmp(scheme, "https") == 0 ? HTTP_ENCRYPTION_ALWAYS
+                                                      : HTTP_ENCRYPTION_IF_REQUESTED),
+                        1, 30000, NULL);
+    if (http == NULL)
+    {
+        logwarn("Unable to connect to %s for %s\n", host, ps->uri);
+        return;
+    }
+    if ((fd = cupsTempFd(tempfile, sizeof(tempfile))) < 0)
     {
-        printer_opts_catalog = cfCatalogOptionArrayNew();
-        cfCatalogLoad(ippGetString(attr, 0, NULL), NULL, printer_opts_catalog);
+        httpClose(http);
+        return;
     }
 
-    translation = cfCatalogLookUpChoice((char *)choice_name, (char *)option_name,
-                                        opts_catalog, printer_opts_catalog);
-    copy = g_strdup(translation);
-    cupsArrayDelete(opts_catalog);
-    cupsArrayDelete(printer_opts_catalog);
-    return copy;
+    /** cupsGetFd() keeps this field across its own requests **/
+    if (ps->catalog && ps->last_modified)
+        httpSetField(http, HTTP_FIELD_IF_MODIFIED_SINCE, ps->last_modified);
+
+    status = cupsGetFd(http, resource, fd);
+    close(fd);
+
+    if (status == HTTP_STATUS_NOT_MODIFIED)
+        logdebug("Strings file %s not modified\n", ps->uri);
+    else if (status == HTTP_STATUS_OK)
+    {
+        logdebug("Downloaded strings file %s\n", ps->uri);
+        catalog = cfCatalogOptionArrayNew();
+        cfCatalogLoad(tempfile, NULL, catalog);
+        cupsArrayDelete(ps->catalog);
+        ps->catalog = catalog;
+
+        last_modified = httpGetField(http, HTTP_FIELD_LAST_MODIFIED);
+        g_free(ps->last_modified);
+        ps->last_modified = (last_modified && last_modified[0] ? g_strdup(last_modified) : NULL);
+        g_free(ps->version);
+        ps->version = (ps->last_modified ? g_strdup(ps->last_modified)
+                                         : g_strdup_printf("%" G_GINT64_FORMAT, g_get_real_time()));
+    }
+    else
+        logwarn("Unable to get %s: %s\n", ps->uri, httpStatus(status));
+
+    unlink(tempfile);
+    httpClose(http);
 }
 
-GVariant *get_printer_translations(PrinterCUPS *p, const char *locale)
+/** The strings file of the printer for the locale, revalidated if due **/
+static PrinterStrings *get_printer_strings(PrinterCUPS *p, const char *locale)
 {
-    int num_opts;
-    Option *opts;
-    GVariant *translations;
-    GVariantBuilder *builder;
+    char *key = g_strdup_printf("%s\n%s", p->name, locale ? locale : "");
+    PrinterStrings *ps;
+    char *uri;
+
+    if (printer_strings == NULL)
+        printer_strings = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                                (GDestroyNotify)free_PrinterStrings);
+
+    ps = g_hash_table_lookup(printer_strings, key);
+    if (ps && ps->checked &&
+        g_get_monotonic_time() - ps->checked < PRINTER_STRINGS_REVALIDATE * G_USEC_PER_SEC)
+    {
+        g_free(key);
+        return ps;
+    }
+
+    /** A modified printer may have moved its strings file **/
+    uri = get_printer_strings_uri(p, locale);
+    if (ps == NULL || g_strcmp0(ps->uri, uri) != 0)
+    {
+        ps = g_new0(PrinterStrings, 1);
+        ps->uri = uri;
+        g_hash_table_insert(printer_strings, key, ps);
+    }
+    else
+    {
+        g_free(uri);
+        g_free(key);
+    }
+
+    if (ps->uri)
+        revalidate_printer_strings(ps);
+    else
+        ps->checked = g_get_monotonic_time();
+    return ps;
+}
+
+/** The parsed strings file of the printer for the locale, NULL if none **/
+static cups_array_t *get_printer_strings_catalog(PrinterCUPS *p, const char *locale)
+{
+    return get_printer_strings(p, locale)->catalog;
+}
+
+/** Which download of the printer's strings file is current, "" if none **/
+static const char *get_printer_strings_version(PrinterCUPS *p, const char *locale)
+{
+    PrinterStrings *ps = get_printer_strings(p, locale);
+
+    return (ps->version ? ps->version : "");
+}
+
+void invalidate_printer_strings(const char *queue_name)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    char *printer_name;
+
+    if (printer_strings == NULL)
+        return;
+
+    g_hash_table_iter_init(&iter, printer_strings);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        printer_name = g_strndup(key, strcspn(key, "\n"));
+        if (printer_name_is_queue(printer_name, queue_name))
+            ((PrinterStrings *)value)->checked = 0;
+        g_free(printer_name);
+    }
+}
+
+/** The translation from the printer's strings, then from the catalog **/
+static const char *lookup_translation(PrinterCUPS *p, const char *locale,
+                                      const char *option_name, const char *choice_name)
+{
+    cups_array_t *printer_catalog = get_printer_strings_catalog(p, locale);
+    const CompiledCatalog *catalog;
+    const char *translation = NULL;
+
+    if (printer_catalog)
+        translation = (choice_name ? cfCatalogLookUpChoice((char *)choice_name, (char *)option_name,
+                                                           printer_catalog, NULL)
+                                   : cfCatalogLookUpOption((char *)option_name, printer_catalog, NULL));
+    if (translation == NULL && (catalog = get_locale_catalog(locale))->header)
+        translation = compiled_catalog_lookup(catalog, option_name, choice_name);
+    return translation;
+}
+
+char *get_option_translation(PrinterCUPS *p,
+                             const char *option_name,
+                             const char *locale)
+{
+    if (get_printer_attributes(p) == NULL)
+        return g_strdup(option_name);
+
+    return g_strdup(lookup_translation(p, locale, option_name, NULL));
+}
+
+char *get_choice_translation(PrinterCUPS *p,
+                             const char *option_name,
+                             const char *choice_name,
+                             const char *locale)
+{
+    if (get_printer_attributes(p) == NULL)
+        return g_strdup(choice_name);
+
+    return g_strdup(lookup_translation(p, locale, option_name, choice_name));
+}
+
+GVariant *get_printer_translations(PrinterCUPS *p, PrinterCapabilities *caps, const char *locale)
+{
+    Option *opts = caps->options;
+    GVariantBuilder builder;
 
     char *group;
     char *name_tr, *group_tr, *choice_tr;
     char *name_key, *group_key, *choice_key;
 
-    num_opts = get_all_options(p, &opts);
-    builder = g_variant_builder_new(G_VARIANT_TYPE(CPDB_TL_DICT_ARGS));
-    for (int i = 0; i < num_opts; i++)
+    g_variant_builder_init(&builder, G_VARIANT_TYPE(CPDB_TL_DICT_ARGS));
+    for (int i = 0; i < caps->num_options; i++)
     {
         /* add translation for option name */
         name_tr = get_option_translation(p, opts[i].option_name, locale);
@@ -2112,18 +5019,18 @@ GVariant *get_printer_translations(PrinterCUPS *p, const char *locale)
         if (name_tr)
         {
             logdebug("Translation '%s' : '%s'\n", name_key, name_tr);
-            g_variant_builder_add(builder, CPDB_TL_ARGS, name_key, name_tr);
+            g_variant_builder_add(&builder, CPDB_TL_ARGS, name_key, name_tr);
         }
         g_free(name_tr);
 
         /* add translation for option group */
         group = cpdbGetGroup(opts[i].option_name);
         group_key = cpdbConcatSep(CPDB_GRP_PREFIX, group);
-        group_tr = cpdbGetGroupTranslation2(group, locale);
+        group_tr = get_group_translation(group, locale);
         if (group_tr)
         {
             logdebug("Translation '%s' : '%s'\n", group_key, group_tr);
-            g_variant_builder_add(builder, CPDB_TL_ARGS, group_key, group_tr);
+            g_variant_builder_add(&builder, CPDB_TL_ARGS, group_key, group_tr);
         }
         g_free(group);
         g_free(group_key);
@@ -2137,7 +5044,7 @@ GVariant *get_printer_translations(PrinterCUPS *p, const char *locale)
             if (choice_tr)
             {
                 logdebug("Translation '%s' : '%s'\n", choice_key, choice_tr);
-                g_variant_builder_add(builder, CPDB_TL_ARGS, choice_key, choice_tr);
+                g_variant_builder_add(&builder, CPDB_TL_ARGS, choice_key, choice_tr);
             }
             g_free(choice_key);
             g_free(choice_tr);
@@ -2145,9 +5052,52 @@ GVariant *get_printer_translations(PrinterCUPS *p, const char *locale)
 
         g_free(name_key);
     }
-    translations = g_variant_builder_end(builder);
-    free_options(num_opts, opts);
 
+    return g_variant_builder_end(&builder);
+}
+
+GVariant *get_cached_translations(BackendObj *b, PrinterCUPS *p, const char *locale)
+{
+    PrinterCapabilities *caps = get_printer_capabilities(b, p);
+    gboolean own_translations = caps->own_translations;
+    GHashTableIter iter;
+    gpointer key;
+    GVariant *translations;
+    char *entry, *prefix;
+
+    /** The option names and choices are the model's; the strings file of
+     * a printer that has one is its own **/
+    if (caps->model && !own_translations)
+        caps = caps->model;
+
+    if (locale == NULL)
+        locale = "";
+    if (caps->translations == NULL)
+        caps->translations = new_translations_table();
+
+    /** The dictionaries are kept per download of the strings file, which
+     * gets revalidated every PRINTER_STRINGS_REVALIDATE seconds **/
+    entry = g_strdup_printf("%s\n%s", locale,
+                            own_translations ? get_printer_strings_version(p, locale) : "");
+    translations = g_hash_table_lookup(caps->translations, entry);
+    if (translations)
+    {
+        logdebug("Using cached %s translations of %s\n", locale, p->name);
+        g_free(entry);
+        return translations;
+    }
+
+    /** Those from an older strings file, or from before they were kept per download **/
+    prefix = g_strdup_printf("%s\n", locale);
+    g_hash_table_iter_init(&iter, caps->translations);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+        if (strcmp(key, locale) == 0 || g_str_has_prefix(key, prefix))
+            g_hash_table_iter_remove(&iter);
+    g_free(prefix);
+
+    translations = g_variant_ref_sink(get_printer_translations(p, caps, locale));
+    g_hash_table_insert(caps->translations, entry, translations);
+    schedule_backend_cache_save(b);
     return translations;
 }
 
@@ -2192,6 +5142,83 @@ GVariant *pack_cups_job(cups_job_t job)
     return tuple_variant;
 }
 
+Arena *arena_new(gsize block_size)
+{
+    Arena *arena = g_new0(Arena, 1);
+    arena->block_size = block_size;
+    arena->block_used = block_size;     /** no block yet **/
+    arena->strings = g_string_chunk_new(block_size);
+    return arena;
+}
+
+void arena_free(Arena *arena)
+{
+    if (arena == NULL)
+        return;
+    g_slist_free_full(arena->blocks, g_free);
+    g_string_chunk_free(arena->strings);
+    g_free(arena);
+}
+
+gpointer arena_alloc(Arena *arena, gsize size)
+{
+    gpointer mem;
+
+    /** keep everything pointer aligned **/
+    size = (size + sizeof(gpointer) - 1) & ~(sizeof(gpointer) - 1);
+
+    /** Big allocations get a block of their own, behind the current one **/
+    if (size > arena->block_size / 4)
+    {
+        mem = g_malloc0(size);
+        if (arena->blocks)
+            arena->blocks->next = g_slist_prepend(arena->blocks->next, mem);
+        else
+        {
+            arena->blocks = g_slist_prepend(arena->blocks, mem);
+            arena->block_used = arena->block_size;
+        }
+        return mem;
+    }
+
+    if (arena->block_used + size > arena->block_size)
+    {
+        arena->blocks = g_slist_prepend(arena->blocks, g_malloc0(arena->block_size));
+        arena->block_used = 0;
+    }
+
+    mem = (char *)arena->blocks->data + arena->block_used;
+    arena->block_used += size;
+    return mem;
+}
+
+char *arena_strdup(Arena *arena, const char *str)
+{
+    if (str == NULL)
+        return NULL;
+    return g_string_chunk_insert_const(arena->strings, str);
+}
+
+char *arena_take_string(Arena *arena, char *str)
+{
+    char *copy = arena_strdup(arena, str);
+    free(str);
+    return copy;
+}
+
+gsize get_resident_memory()
+{
+    unsigned long size, resident;
+    FILE *fp = fopen("/proc/self/statm", "r");
+
+    if (fp == NULL)
+        return 0;
+    if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+    return (gsize)resident * sysconf(_SC_PAGESIZE);
+}
+
 void free_string(char *str)
 {
     if (str)
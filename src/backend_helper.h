@@ -12,10 +12,55 @@
 
 #include <cpdb/backend.h>
 
+#include "cups-extensions.h"
+
 /* For cups-notifier */
 #define NOTIFY_LEASE_DURATION (24 * 60 * 60)
 #define CUPS_DBUS_PATH "/org/cups/cupsd/Notifier"
 
+/** How long (in seconds) resolved and unresolvable printer hosts are remembered **/
+#define HOST_CACHE_TTL 300
+#define HOST_CACHE_NEGATIVE_TTL 30
+/** Seconds to wait for the network to settle before printers are reclassified **/
+#define NETWORK_CHANGED_DELAY 2
+
+/** The persistent cache of printers and their options, under the user cache dir **/
+#define BACKEND_CACHE_DIR "cpdb"
+#define BACKEND_CACHE_FILE "cups-backend.cache"
+#define BACKEND_CACHE_MAGIC "CPDB-CUPS-CACHE"
+#define BACKEND_CACHE_VERSION 4
+/** Seconds to wait for more changes before the cache file is written **/
+#define BACKEND_CACHE_SAVE_DELAY 5
+
+/** The compiled option catalogs, one file per locale, under the cache dir **/
+#define COMPILED_CATALOG_DIR "catalogs"
+#define COMPILED_CATALOG_MAGIC "CPDBCAT"
+#define COMPILED_CATALOG_VERSION 1
+
+/** How often the user printed to and opened each printer, under the user data dir **/
+#define BACKEND_USAGE_FILE "cups-usage.conf"
+/** A job counts this many times as much as opening the options **/
+#define USAGE_PRINT_WEIGHT 4
+
+/** Defaults of CPDB_CUPS_LINGER_TIMEOUT (seconds) and CPDB_CUPS_LINGER_MAX_MEMORY (MiB) **/
+#define DEFAULT_LINGER_TIMEOUT 30
+#define DEFAULT_LINGER_MAX_MEMORY 256
+
+/** Threads fetching options ahead of GetAllOptions, 0 to not prefetch **/
+#define DEFAULT_PREFETCH_THREADS 2
+/** At most this many prefetch threads, whatever the environment says **/
+#define MAX_PREFETCH_THREADS 16
+/** Printers whose options are prefetched after a dialog got the list **/
+#define DEFAULT_PREFETCH_COUNT 3
+
+/** Seconds a downloaded printer strings file is used before it is revalidated **/
+#define PRINTER_STRINGS_REVALIDATE 300
+
+/** Block size of the arenas holding the options and media of a printer **/
+#define CAPABILITIES_ARENA_BLOCK_SIZE 8192
+/** Block size of the arenas holding the defaults a queue sets on its own **/
+#define QUEUE_ARENA_BLOCK_SIZE 1024
+
 /* New Debug macros */
 #define BACKEND_NAME "CUPS"
 #define logdebug(...) cpdbBDebugPrintf(CPDB_DEBUG_LEVEL_DEBUG, BACKEND_NAME, __VA_ARGS__)
@@ -38,20 +83,62 @@ typedef struct _PrinterCUPS
     char *name;
     cups_dest_t *dest;
     http_t *http;
+    /** only needed for printing, see ensure_printer_dinfo() **/
     cups_dinfo_t *dinfo;
+    /** response to the one Get-Printer-Attributes request made for the printer **/
+    ipp_t *attrs;
     char *stream_socket_path;
 } PrinterCUPS;
 
+/**
+ * A CUPS destination in the backend-wide printer snapshot, tagged with the
+ * properties the dialogs filter on, so that filtering needs no CUPS or
+ * name service requests
+ */
+typedef struct _PrinterEntry
+{
+    gint ref_count;
+    char *name;
+    cups_dest_t *dest;
+    /** the CPDB_PRINTER_ARGS tuple sent to the dialogs, built when first
+     * needed and dropped whenever the printer changes **/
+    GVariant *record;
+    gboolean is_temporary;
+    gboolean is_remote;
+    /** host still being resolved, is_remote is provisional until then **/
+    char *pending_host;
+    /** printer-config-change-time of the queue, NULL if CUPS did not report it **/
+    char *config_stamp;
+} PrinterEntry;
+
+/**
+ * A streaming printer listing for a dialog. It is shared between the dialog
+ * and the worker thread running the enumeration, so it is reference counted
+ * and outlives the dialog if needed.
+ */
+typedef struct _StreamListing
+{
+    gint ref_count;
+    /** set atomically to stop the enumeration, also polled by cupsEnumDests() **/
+    gint cancel;
+    char *dialog_name;
+    /** snapshot generation the listing was started in **/
+    guint generation;
+} StreamListing;
+
 /**
  * Represents a frontend instance that the backend is associated with
  */
 typedef struct _Dialog
 {
-    int cancel;
+    /** the running streaming listing for the dialog, if any **/
+    StreamListing *listing;
     gboolean hide_remote;
     gboolean hide_temp;
     GHashTable *printers;
     gboolean keep_alive;
+    /** cancelled when the dialog goes away, stops its prefetches **/
+    GCancellable *prefetch_cancel;
 } Dialog;
 
 typedef struct _Mappings
@@ -70,6 +157,8 @@ typedef struct _BackendObj
 {
     GDBusConnection *dbus_connection;
     PrintBackend *skeleton;
+    /** the methods beyond the CPDB backend interface **/
+    CupsExtensions *extensions;
     char *obj_path;
 
     /** the hash table to map from dialog name(char*) to the Dialog struct(Dialog*) **/
@@ -77,8 +166,87 @@ typedef struct _BackendObj
 
     int num_frontends;
     char *default_printer;
+
+    /** backend-wide snapshot of all CUPS destinations, shared by all dialogs;
+     * maps printer name(char*) to PrinterEntry*, NULL if it needs to be re-enumerated **/
+    GHashTable *printer_snapshot;
+
+    /** bumped on every invalidation of the snapshot **/
+    guint snapshot_generation;
+    /** whether an enumeration is running on a worker thread **/
+    gboolean snapshot_enumerating;
+    /** requests waiting for the snapshot (SnapshotWaiter*) **/
+    GList *snapshot_waiters;
+    /** the snapshot is served as is, but gets replaced by a new enumeration **/
+    gboolean snapshot_revalidating;
+
+    /** signal printers to the dialogs as they are discovered if there is no
+     * snapshot yet, instead of letting the listing wait for the enumeration **/
+    gboolean stream_listing;
+
+    /** options and media of the printers asked for by the dialogs;
+     * maps printer name(char*) to PrinterCapabilities* **/
+    GHashTable *capabilities;
+    /** the sets shared by the printers with the same options and media,
+     * see get_model_key(); maps model key(char*) to PrinterCapabilities*,
+     * dropped once no printer uses them **/
+    GHashTable *models;
+
+    /** pending write of the persistent cache, 0 if none **/
+    guint cache_save_source;
+
+    /** seconds to stay around after the last dialog is gone, 0 to exit at once **/
+    guint linger_timeout;
+    /** don't linger with more resident memory than this (bytes), 0 for no limit **/
+    gsize linger_max_memory;
+    /** running linger timeout, 0 if none **/
+    guint linger_source;
+
+    /** workers fetching the options of likely printers, NULL if disabled **/
+    GThreadPool *prefetch_pool;
+    /** at most this many printers are prefetched per listing **/
+    guint prefetch_count;
+    /** printers to prefetch after the default one, from the environment **/
+    char **prefetch_printers;
+    /** printers being prefetched; maps printer name(char*) to the requests
+     * waiting for the prefetch (GList* of PrefetchWaiter*) **/
+    GHashTable *prefetching;
+    /** bumped whenever cached options are dropped, so that prefetches
+     * started before are discarded **/
+    guint capabilities_generation;
+
+    /** per printer group, the "prints" and "selections" counts of the user **/
+    GKeyFile *usage;
+    /** pending write of the usage file, 0 if none **/
+    guint usage_save_source;
 } BackendObj;
 
+/** Called with the host (or DNS-SD service URI) that has been resolved **/
+typedef void (*HostResolvedFunc)(const char *host, gpointer user_data);
+
+/**
+ * Called on the main loop once the printer snapshot is available.
+ * The snapshot is owned by the backend and must not be kept around.
+ */
+typedef void (*SnapshotReadyFunc)(BackendObj *b, GHashTable *snapshot, gpointer user_data);
+
+/** Called on the main loop once the printer is not being prefetched **/
+typedef void (*PrefetchDoneFunc)(BackendObj *b, gpointer user_data);
+
+/**
+ * Allocates the strings and arrays of a capability set in a few large
+ * blocks, which are all released at once with arena_free()
+ */
+typedef struct _Arena
+{
+    /** the allocated blocks, the current one first **/
+    GSList *blocks;
+    gsize block_size;
+    gsize block_used;
+    /** strings, identical ones are stored once **/
+    GStringChunk *strings;
+} Arena;
+
 /**
  * Represents a single 'option' for a printer
  */
@@ -88,6 +256,10 @@ typedef struct _Option
     int num_supported;
     char **supported_values;
     char *default_value;
+    /** index into the static table of the options CUPS always offers, which
+     * option_name and supported_values then point into and must not be
+     * freed; -1 for other options **/
+    int fixed_index;
 } Option;
 
 /**
@@ -99,9 +271,49 @@ typedef struct _Media
 	int width;
 	int length;
 	int num_margins;
-	int (*margins)[4]; /** int margins[num_margins][4]; left(0), right(1), top(2), bottom(3) **/
+	int (*margins)[4]; /** int margins[num_margins][4]; left(0), right(1), top(2), bottom(3);
+	                    * distinct tuples only, a run of the printer's margin table **/
 } Media;
 
+/**
+ * The complete option and media set of a printer, as sent by GetAllOptions.
+ *
+ * The printers whose options and media are the same share one set, the
+ * model set. The set of a queue refers to it for everything but the
+ * defaults, which are the queue's own.
+ */
+typedef struct _PrinterCapabilities
+{
+    gint ref_count;
+    /** holds the options and media, and everything in them; for a queue
+     * just its own defaults, NULL if it has none **/
+    Arena *arena;
+    /** the model set the queue set is derived from, NULL for model sets and
+     * for sets of printers that could not be asked **/
+    struct _PrinterCapabilities *model;
+    /** the key of a model set in BackendObj.models, NULL otherwise **/
+    char *model_key;
+    /** the printer has a strings file of its own, so its translations are
+     * kept with the queue set rather than the model set **/
+    gboolean own_translations;
+    /** printer-config-change-time of the printer the set was read from,
+     * "" if CUPS did not report it **/
+    char *config_stamp;
+    int num_options;
+    Option *options;
+    int num_media;
+    Media *media;
+    /** the serialized GetAllOptions reply, built on first use, NULL before **/
+    GVariant *reply;
+    /** version of the set for conditional queries, a hash of the reply **/
+    char *etag;
+    /** GetAllTranslations dictionaries of the set, kept with the model set
+     * unless own_translations; maps "locale\nversion"(char*) to a{ss}
+     * GVariant*, version naming the download of the strings file it was
+     * built from, "" if there is none **/
+    GHashTable *translations;
+} PrinterCapabilities;
+
 typedef struct _PrintDataThreadData {
     PrinterCUPS *printer;
     int num_options;
@@ -110,11 +322,6 @@ typedef struct _PrintDataThreadData {
     struct sockaddr_un server_addr;
 } PrintDataThreadData;
 
-typedef struct _AddressList {
-    char ipstr[INET6_ADDRSTRLEN];
-    int family;
-} AddressList;
-
 /********Backend related functions*******************/
 
 /** Get a printer name for a CUPS destination.
@@ -128,10 +335,23 @@ BackendObj *get_new_BackendObj();
 /** Get the printer-id of the default printer of the CUPS Backend**/
 char *get_default_printer(BackendObj *b);
 
+/** Call func with the backend-wide snapshot of all CUPS destinations.
+ * If there is no valid snapshot, the destinations are enumerated on a
+ * worker thread and func is called from the main loop when that is done.
+ */
+void request_printer_snapshot(BackendObj *b, SnapshotReadyFunc func, gpointer user_data);
+
+/** Drop the printer snapshot, so that the next listing enumerates again **/
+void invalidate_printer_snapshot(BackendObj *b);
+
+/** Keep serving the snapshot, but enumerate again and update the dialogs with the result **/
+void revalidate_printer_snapshot(BackendObj *b);
+
 /** Connect the BackendObj to the dbus **/
 void connect_to_dbus(BackendObj *, char *obj_path);
 
-/** Add the dialog to the list of dialogs of the particular backend**/
+/** Add the dialog to the list of dialogs of the particular backend; a dialog
+ * listed already keeps its settings and has its printers cleared **/
 void add_frontend(BackendObj *, const char *dialog_name);
 
 /** Remove the dialog from the list of frontends that this backend is 
@@ -148,12 +368,23 @@ gboolean no_frontends(BackendObj *);
 Dialog* find_dialog(BackendObj * , const char* dialog_name);
 
 /** Get the variable which controls the cancellation of the enumeration thread for
- * that particular dialog 
+ * that particular dialog, NULL if there is no streaming listing running
  */
 int *get_dialog_cancel(BackendObj *, const char *dialog_name);
 
-void set_dialog_cancel(BackendObj *, const char *dialog_name);   //make cancel = 0
-void reset_dialog_cancel(BackendObj *, const char *dialog_name); //make cancel = 1
+void set_dialog_cancel(BackendObj *, const char *dialog_name);   //make cancel = 1
+void reset_dialog_cancel(BackendObj *, const char *dialog_name); //make cancel = 0
+
+/** Start a new streaming listing for the dialog, cancelling a running one.
+ * Returns a new reference for the thread running it.
+ */
+StreamListing *start_dialog_listing(BackendObj *, const char *dialog_name);
+
+/** Whether the listing is still the current one of its dialog and not cancelled **/
+gboolean dialog_listing_active(BackendObj *, StreamListing *listing);
+
+StreamListing *ref_StreamListing(StreamListing *listing);
+void unref_StreamListing(StreamListing *listing);
 
 /** Returns whether remote CUPS printers are hidden for this dialog **/
 gboolean get_hide_remote(BackendObj *b, const char *dialog_name);
@@ -202,14 +433,47 @@ void remove_printer_from_dialog(BackendObj *, const char *dialog_name, const cha
 
 void send_printer_state_changed_signal(BackendObj *b, const char *dialog_name, const char *printer_name,
                                         const char *printer_state, gboolean printer_is_accepting_jobs);
-void send_printer_added_signal(BackendObj *b, const char *dialog_name, cups_dest_t *dest);
+void send_printer_added_signal(BackendObj *b, const char *dialog_name, PrinterEntry *e);
 void send_printer_removed_signal(BackendObj *b, const char *dialog_name, const char *printer_name);
 void notify_removed_printers(BackendObj *b, const char *dialog_name, GHashTable *new_table);
 void notify_added_printers(BackendObj *b, const char *dialog_name, GHashTable *new_table);
 void replace_printers(BackendObj *b, const char *dialog_name, GHashTable *new_table);
 void refresh_printer_list(BackendObj *b, const char *dialog_name);
+
+/**
+ * Bring the printer lists of all dialogs in line with the printer snapshot,
+ * enumerating the destinations only once for all of them
+ */
+void refresh_all_printer_lists(BackendObj *b);
+
+/** Add a printer found by a streaming listing to the dialog, if its filters allow **/
+void add_streamed_printer(BackendObj *b, StreamListing *listing,
+                          const char *printer_name, PrinterEntry *e);
+
+/** Make the printers found by a complete streaming listing the printer snapshot **/
+void install_streamed_snapshot(BackendObj *b, StreamListing *listing, GHashTable *printers);
+
+/**
+ * Look up a single CUPS queue and its known instances on a worker thread
+ * and add, update or remove them in the printer snapshot and in every
+ * dialog's printer list, sending the matching signals. Dialogs already
+ * showing them get the new destinations. Used for the CUPS notifier events, so that one
+ * added or modified queue does not cause a full re-enumeration.
+ */
+void update_single_printer(BackendObj *b, const char *queue_name);
+
+/** Remove a CUPS queue (and its instances) from the snapshot and all dialogs **/
+void remove_single_printer(BackendObj *b, const char *queue_name);
+
+/** Classify the snapshot printers again whose host has just been resolved **/
+void reclassify_printers_on_host(BackendObj *b, const char *host);
+
+/** Update the state of a CUPS queue from a notifier event and tell the dialogs **/
+void update_printer_state(BackendObj *b, const char *queue_name,
+                          guint printer_state, gboolean printer_is_accepting_jobs);
 GHashTable *get_dialog_printers(BackendObj *b, const char *dialog_name);
 cups_dest_t *get_dest_by_name(BackendObj *b, const char *dialog_name, const char *printer_name);
+/** The dialog's printer of that name, NULL if the dialog or the printer is unknown **/
 PrinterCUPS *get_printer_by_name(BackendObj *b, const char *dialog_name, const char *printer_name);
 
 /*********Printer related functions******************/
@@ -220,9 +484,47 @@ PrinterCUPS *get_new_PrinterCUPS(const cups_dest_t *dest);
 /** Free up the memory used by the struct **/
 void free_PrinterCUPS(PrinterCUPS *);
 
+/** Get a new snapshot entry for a copy of the cups destination.
+ * This classifies the destination, so it may block on the network.
+ * Entries are reference counted, so that they can be handed between threads.
+ */
+PrinterEntry *get_new_PrinterEntry(const cups_dest_t *dest);
+PrinterEntry *ref_PrinterEntry(PrinterEntry *e);
+void unref_PrinterEntry(PrinterEntry *e);
+
+/** Get the CPDB_PRINTER_ARGS tuple describing the printer (borrowed reference) **/
+GVariant *get_printer_entry_record(PrinterEntry *e);
+
+/** The printer-config-change-time of the CUPS queues by printer-name, or of
+ * only the given queue, with one CUPS-Get-Printers request; cupsEnumDests()
+ * does not report it. Blocks on the server, for worker threads **/
+GHashTable *fetch_config_stamps(const char *queue_name);
+
+/** Set the config change time of the snapshot entries from fetch_config_stamps() **/
+void set_config_stamps(GHashTable *printers, GHashTable *stamps);
+
+/** Whether the snapshot entry is shown to a dialog with the given filters **/
+gboolean printer_entry_visible(const PrinterEntry *e, gboolean hide_temp, gboolean hide_remote);
+
 /** Ensure that we have a connection the server**/
 gboolean ensure_printer_connection(PrinterCUPS *p);
 
+/** Ensure that we have the destination info needed to submit jobs **/
+gboolean ensure_printer_dinfo(PrinterCUPS *p);
+
+/**
+ * Get all the attributes of the printer the backend uses, with a single
+ * Get-Printer-Attributes request made the first time. NULL if the request failed.
+ */
+ipp_t *get_printer_attributes(PrinterCUPS *p);
+
+/** Forget the attributes and destination info, so that they are fetched again **/
+void reset_printer_attributes(PrinterCUPS *p);
+
+/** Find "<option_name>-supported" and "<option_name>-default" in the printer attributes **/
+ipp_attribute_t *find_printer_supported(PrinterCUPS *p, const char *option_name);
+ipp_attribute_t *find_printer_default(PrinterCUPS *p, const char *option_name);
+
 /**
  * Get state of the printer
  * state is one of the following {"idle" , "processing" , "stopped"}
@@ -233,15 +535,68 @@ char *get_default(PrinterCUPS *p, char *option_name);
 int get_supported(PrinterCUPS *p, char ***supported_values, const char *option_name);
 int get_job_creation_attributes(PrinterCUPS *p, char ***values);
 
-int get_all_options(PrinterCUPS *p, Option **options);
-int get_all_media(PrinterCUPS *p, Media **medias);
-int add_media_to_options(PrinterCUPS *p, Media *medias, int media_count, Option **options, int count);
+/** The options, media and the media options of the printer, allocated from the arena **/
+int get_all_options(PrinterCUPS *p, Arena *arena, Option **options);
+int get_all_media(PrinterCUPS *p, Arena *arena, Media **medias);
+int add_media_to_options(PrinterCUPS *p, Arena *arena, Media *medias, int media_count, Option **options, int count);
+
+/** The cached options and media of the printer, NULL if none or outdated **/
+PrinterCapabilities *lookup_printer_capabilities(BackendObj *b, PrinterCUPS *p);
+
+/** Get the options and media of the printer, querying it only the first time;
+ * printers with the same options and media keep them only once **/
+PrinterCapabilities *get_printer_capabilities(BackendObj *b, PrinterCUPS *p);
+
+/** The GetAllOptions reply tuple for the set; owned by caps, shared by all callers **/
+GVariant *get_capabilities_reply(PrinterCapabilities *caps);
+
+/**
+ * The GetOptions reply for just the named options, with the media if
+ * "media" is among them. Uses the cached set if there is one, otherwise
+ * asks the printer for the attributes of those options only.
+ */
+GVariant *get_selected_options_reply(BackendObj *b, PrinterCUPS *p,
+                                     const char *const *option_names);
+
+/** The version token of the set, the same for sets with the same content **/
+const char *get_capabilities_etag(PrinterCapabilities *caps);
+
+/** Forget the cached options and media of the queue and its instances **/
+void invalidate_printer_capabilities(BackendObj *b, const char *queue_name);
+
+/**
+ * Fetch the options of the default printer and of the configured likely
+ * printers of the dialog in the background, each on its own connection
+ */
+void prefetch_printer_capabilities(BackendObj *b, const char *dialog_name);
+
+/**
+ * Call func once the running prefetch of the printer is done, so that the
+ * options are not fetched twice; at once if there is none
+ */
+void when_prefetch_done(BackendObj *b, const char *printer_name,
+                        PrefetchDoneFunc func, gpointer user_data);
 
 static void *print_data_thread(void *data);
 void print_socket(PrinterCUPS *p, int num_settings, GVariant *settings, char *job_id_str, char *socket_path, const char *title);
 
 
+/** Whether the host of the URI is not the local machine, without any name resolution **/
 gboolean checkRemote(const char *uri);
+
+/** Rebuild the set of local addresses used by checkRemote() after a network
+ * change. If it changed, forget the resolved printer hosts and DNS-SD
+ * services and return TRUE **/
+gboolean refresh_local_addresses();
+
+/** Classify the host of the URI like checkRemote(). If the host is still being
+ * resolved, the result is provisional and the host is returned (free() it).
+ */
+char *uri_remote_host(const char *uri, gboolean *remote);
+
+/** Called on the main loop when a host looked up by checkRemote(), or a
+ * DNS-SD service URI, has been resolved **/
+void set_host_resolved_callback(HostResolvedFunc func, gpointer user_data);
 char *extractHostFromURI(const char *uri);
 /**
  * Get translation of choice name for a given locale
@@ -256,22 +611,71 @@ char *get_choice_translation(PrinterCUPS *p, const char *option_name,
                              const char *choice_name, const char *locale);
 
 /**
- * Get translations for all printer strings
+ * Have the strings file of the printer checked for changes on its next
+ * use, for the queue and its instances
+ */
+void invalidate_printer_strings(const char *queue_name);
+
+/**
+ * Get translation of group name for a given locale
  */
-GVariant *get_printer_translations(PrinterCUPS *p, const char *locale);
+char *get_group_translation(const char *group_name, const char *locale);
+
+/**
+ * Get translations for all printer strings of the option set
+ */
+GVariant *get_printer_translations(PrinterCUPS *p, PrinterCapabilities *caps, const char *locale);
+
+/**
+ * The translations of the printer's options for the locale, built once
+ * per option set and kept with it, rebuilt when the printer's strings
+ * file changes; owned by the set
+ */
+GVariant *get_cached_translations(BackendObj *b, PrinterCUPS *p, const char *locale);
 
 
 void tryPPD(PrinterCUPS *p);
+/*********Persistent cache*****************/
+
+/** Serve the printer snapshot and option sets saved by the previous run,
+ * and revalidate the snapshot in the background
+ */
+void load_backend_cache(BackendObj *b);
+
+/** Write the printer snapshot and the option sets to the cache file **/
+gboolean save_backend_cache(BackendObj *b);
+
+/** Write the cache file a little later, collecting further changes **/
+void schedule_backend_cache_save(BackendObj *b);
+
+/*********Printer usage*****************/
+
+/** Read the usage counts of the user's printers **/
+void load_printer_usage(BackendObj *b);
+gboolean save_printer_usage(BackendObj *b);
+
+/** Count a job sent to the printer, or its options being opened **/
+void record_printer_use(BackendObj *b, const char *printer_name, gboolean printed);
+
+/** How much the printer is used, 0 if never **/
+guint get_printer_usage_score(BackendObj *b, const char *printer_name);
+
+/** Order printer names by usage, the most used first, then by name **/
+gint compare_printer_usage(gconstpointer a, gconstpointer b, gpointer backend);
+
 /**********Dialog related funtions ****************/
 Dialog *get_new_Dialog();
 void free_Dialog(Dialog *);
 
 /*********Option related functions*****************/
 void print_option(const Option *opt);
-void free_options(int count, Option *opts);
+PrinterCapabilities *ref_PrinterCapabilities(PrinterCapabilities *caps);
+void unref_PrinterCapabilities(PrinterCapabilities *caps);
 void unpack_option_array(GVariant *var, int num_options, Option **options);
 GVariant *pack_option(const Option *opt);
 GVariant *pack_media(const Media *media);
+/** The margins of the media as a(iiii), serialized straight from the table **/
+GVariant *pack_margins(const Media *media);
 /**********Mapping related functions*****************/
 Mappings *get_new_Mappings();
 
@@ -279,12 +683,24 @@ Mappings *get_new_Mappings();
 const char *cups_printer_state(cups_dest_t *dest);
 gboolean cups_is_accepting_jobs(cups_dest_t *dest);
 void cups_get_Resolution(cups_dest_t *dest, int *xres, int *yres);
+int add_printer_to_ht(void *user_data, unsigned flags, cups_dest_t *dest);
 GHashTable *cups_get_all_printers();
 GHashTable *cups_get_local_printers();
 char *cups_retrieve_string(cups_dest_t *dest, const char *option_name);
 gboolean cups_is_temporary(cups_dest_t *dest);
 gboolean cups_is_remote(cups_dest_t *dest);
+
+/** Like cups_is_remote(), but returns the host (free() it) if the result is
+ * provisional until that host has been resolved. A DNS-SD service is resolved
+ * in the background, the device URI is returned until then.
+ */
+char *cups_classify_remote(cups_dest_t *dest, gboolean *remote);
+
+/** Classify a printer again by the pending host cups_classify_remote() returned,
+ * from the caches only; returns what it still waits for (free() it) **/
+char *classify_pending_host(const char *pending_host, gboolean *remote);
 GHashTable *cups_get_printers(gboolean notemp, gboolean noremote);
+void free_cups_dest(cups_dest_t *dest);
 char *extract_ipp_attribute(ipp_attribute_t *, int index, const char *option_name);
 char *extract_res_from_ipp(ipp_attribute_t *, int index);
 char *extract_string_from_ipp(ipp_attribute_t *attr, int index);
@@ -295,6 +711,22 @@ char *translate_job_state(ipp_jstate_t);
 
 /***************Misc.** **********************/
 
+/** Get a new arena, allocating blocks of at least block_size bytes **/
+Arena *arena_new(gsize block_size);
+void arena_free(Arena *arena);
+
+/** Get zeroed memory from the arena **/
+gpointer arena_alloc(Arena *arena, gsize size);
+
+/** Copy the string into the arena, NULL stays NULL **/
+char *arena_strdup(Arena *arena, const char *str);
+
+/** Move a malloc()ed string into the arena, freeing it **/
+char *arena_take_string(Arena *arena, char *str);
+
+/** Resident memory of the backend process in bytes, 0 if unknown **/
+gsize get_resident_memory();
+
 /**error logging */
 void MSG_LOG(const char *msg, int msg_level);
 void free_string(char *);
@@ -18,23 +18,18 @@ on_name_acquired(GDBusConnection *connection,
                  const gchar *name,
                  gpointer not_used);
 static void acquire_session_bus_name();
-gpointer list_printers(gpointer _dialog_name);
-int send_printer_added(void *_dialog_name, unsigned flags, cups_dest_t *dest);
+static void list_printers(GTask *task, gpointer source_object,
+                          gpointer task_data, GCancellable *cancellable);
+int send_printer_added(void *_stream, unsigned flags, cups_dest_t *dest);
 void connect_to_signals();
 
 BackendObj *b;
+static GMainLoop *loop = NULL;
+static guint network_changed_source = 0;
 
 void update_printer_lists()
 {
-    GHashTableIter iter;
-    gpointer key, value;
-
-    g_hash_table_iter_init(&iter, b->dialogs);
-    while (g_hash_table_iter_next(&iter, &key, &value))
-    {
-        const char *dialog_name = key;
-        refresh_printer_list(b, dialog_name);
-    }
+    refresh_all_printer_lists(b);
 }
 
 static void
@@ -48,19 +43,7 @@ on_printer_state_changed (CupsNotifier *object,
                           gpointer user_data)
 {
     logdebug("Printer state change on printer %s: %s\n", printer, text);
-    
-    GHashTableIter iter;
-    gpointer key, value;
-
-    g_hash_table_iter_init(&iter, b->dialogs);
-    while (g_hash_table_iter_next(&iter, &key, &value))
-    {
-        const char *dialog_name = key;
-        PrinterCUPS *p = get_printer_by_name(b, dialog_name, printer);
-        const char *state = get_printer_state(p);
-        send_printer_state_changed_signal(b, dialog_name, printer,
-                                            state, printer_is_accepting_jobs);
-    }
+    update_printer_state(b, printer, printer_state, printer_is_accepting_jobs);
 }
 
 static void
@@ -74,7 +57,7 @@ on_printer_added (CupsNotifier *object,
                   gpointer user_data)
 {
     logdebug("Printer added: %s\n", text);
-    update_printer_lists();
+    update_single_printer(b, printer);
 }
 
 static void
@@ -88,7 +71,85 @@ on_printer_deleted (CupsNotifier *object,
                     gpointer user_data)
 {
     logdebug("Printer deleted: %s\n", text);
+    invalidate_printer_capabilities(b, printer);
+    remove_single_printer(b, printer);
+}
+
+static void
+on_printer_modified (CupsNotifier *object,
+                     const gchar *text,
+                     const gchar *printer_uri,
+                     const gchar *printer,
+                     guint printer_state,
+                     const gchar *printer_state_reasons,
+                     gboolean printer_is_accepting_jobs,
+                     gpointer user_data)
+{
+    logdebug("Printer modified: %s\n", text);
+    invalidate_printer_capabilities(b, printer);
+    update_single_printer(b, printer);
+}
+
+static void
+on_printer_capabilities_changed (CupsNotifier *object,
+                                 const gchar *text,
+                                 const gchar *printer_uri,
+                                 const gchar *printer,
+                                 guint printer_state,
+                                 const gchar *printer_state_reasons,
+                                 gboolean printer_is_accepting_jobs,
+                                 gpointer user_data)
+{
+    logdebug("Printer media or finishings changed: %s\n", text);
+    invalidate_printer_capabilities(b, printer);
+}
+
+static void
+on_server_restarted (CupsNotifier *object,
+                     const gchar *text,
+                     gpointer user_data)
+{
+    logdebug("CUPS server restarted: %s\n", text);
+    g_hash_table_remove_all(b->capabilities);
+    g_hash_table_remove_all(b->models);
+    b->capabilities_generation++;
+    schedule_backend_cache_save(b);
+    invalidate_printer_snapshot(b);
+    update_printer_lists();
+}
+
+static void
+on_host_resolved (const char *host, gpointer user_data)
+{
+    reclassify_printers_on_host(b, host);
+}
+
+static gboolean
+network_changed_timeout (gpointer user_data)
+{
+    network_changed_source = 0;
+    if (!refresh_local_addresses())
+    {
+        logdebug("Network changed, local addresses did not\n");
+        return G_SOURCE_REMOVE;
+    }
+    logdebug("Network changed, reclassifying printers\n");
+    invalidate_printer_snapshot(b);
     update_printer_lists();
+    return G_SOURCE_REMOVE;
+}
+
+static void
+on_network_changed (GNetworkMonitor *monitor,
+                    gboolean network_available,
+                    gpointer user_data)
+{
+    /** The monitor signals every route and interface change, often
+     * several in a row; act once they have settled **/
+    if (network_changed_source)
+        g_source_remove(network_changed_source);
+    network_changed_source = g_timeout_add_seconds(NETWORK_CHANGED_DELAY,
+                                                   network_changed_timeout, NULL);
 }
 
 int main()
@@ -98,6 +159,8 @@ int main()
 
     b = get_new_BackendObj();
     cpdbInit();
+    load_backend_cache(b);
+    load_printer_usage(b);
     acquire_session_bus_name(BUS_NAME);
 
     int subscription_id = create_subscription();
@@ -123,14 +186,28 @@ int main()
     if (cups_notifier != NULL)
     {
         g_signal_connect(cups_notifier, "printer-state-changed",
-                            G_CALLBACK(on_printer_deleted), NULL);
+                            G_CALLBACK(on_printer_state_changed), NULL);
         g_signal_connect(cups_notifier, "printer-deleted",
                             G_CALLBACK(on_printer_deleted), NULL);
         g_signal_connect(cups_notifier, "printer-added",
                             G_CALLBACK(on_printer_added), NULL);
+        g_signal_connect(cups_notifier, "printer-modified",
+                            G_CALLBACK(on_printer_modified), NULL);
+        g_signal_connect(cups_notifier, "printer-media-changed",
+                            G_CALLBACK(on_printer_capabilities_changed), NULL);
+        g_signal_connect(cups_notifier, "printer-finishings-changed",
+                            G_CALLBACK(on_printer_capabilities_changed), NULL);
+        g_signal_connect(cups_notifier, "server-restarted",
+                            G_CALLBACK(on_server_restarted), NULL);
     }
 
-    GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+    /** Printers are classified as local or remote against the addresses
+     * of this machine, which change with the network **/
+    g_signal_connect(g_network_monitor_get_default(), "network-changed",
+                     G_CALLBACK(on_network_changed), NULL);
+    set_host_resolved_callback(on_host_resolved, NULL);
+
+    loop = g_main_loop_new(NULL, FALSE);
     g_main_loop_run(loop);
 
     /* Main loop exited */
@@ -138,6 +215,19 @@ int main()
     g_main_loop_unref(loop);
     loop = NULL;
 
+    /** Drop the prefetches not started yet, nothing picks up the results **/
+    if (b->prefetch_pool)
+        g_thread_pool_free(b->prefetch_pool, TRUE, FALSE);
+
+    if (b->cache_save_source)
+        g_source_remove(b->cache_save_source);
+    save_backend_cache(b);
+    if (b->usage_save_source)
+    {
+        g_source_remove(b->usage_save_source);
+        save_printer_usage(b);
+    }
+
     cancel_subscription(subscription_id);
     if (cups_notifier)
         g_object_unref(cups_notifier);
@@ -162,123 +252,216 @@ on_name_acquired(GDBusConnection *connection,
 {
     b->dbus_connection = connection;
     b->skeleton = print_backend_skeleton_new();
+    b->extensions = cups_extensions_skeleton_new();
     connect_to_signals();
     connect_to_dbus(b, CPDB_BACKEND_OBJ_PATH);
 }
 
-static gboolean on_handle_get_all_printers(PrintBackend *interface,
-                                           GDBusMethodInvocation *invocation,
-                                           gpointer user_data)
+/**
+ * A GetAllPrinters or GetFilteredPrinterList call waiting for the
+ * printer snapshot
+ */
+typedef struct _ListingRequest
+{
+    PrintBackend *interface;
+    GDBusMethodInvocation *invocation;
+    gboolean filtered;
+    gboolean hide_temp;
+    gboolean hide_remote;
+} ListingRequest;
+
+/**
+ * Pack the printers of the backend-wide snapshot for the dialog, adding
+ * them to the dialog's printer list on the way.
+ */
+static GVariant *pack_printer_list(GHashTable *table,
+                                   const char *dialog_name,
+                                   gboolean hide_temp,
+                                   gboolean hide_remote,
+                                   int *num_printers)
 {
-    int num_printers;
     GHashTableIter iter;
     gpointer key, value;
     GVariantBuilder builder;
-    GVariant *printer, *printers;
+    GPtrArray *names;
+    PrinterEntry *e;
 
-    cups_dest_t *dest;
-    gboolean accepting_jobs;
-    const char *state;
-    char *name, *info, *location, *make;
+    names = g_ptr_array_new();
+    g_hash_table_iter_init(&iter, table);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        if (printer_entry_visible(value, hide_temp, hide_remote))
+            g_ptr_array_add(names, key);
 
-    GHashTable *table = cups_get_all_printers();
-    const char *dialog_name = g_dbus_method_invocation_get_sender(invocation);
+    /** The printers the user prints to the most come first **/
+    g_ptr_array_sort_with_data(names, compare_printer_usage, b);
 
-    add_frontend(b, dialog_name);
-    num_printers = g_hash_table_size(table);
-    if (num_printers == 0)
+    *num_printers = 0;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(v)"));
+    for (guint i = 0; i < names->len; i++)
     {
-        printers = g_variant_new_array(G_VARIANT_TYPE ("(v)"), NULL, 0);
-        print_backend_complete_get_all_printers(interface, invocation, 0, printers);
-        return TRUE;
-    }
+        e = g_hash_table_lookup(table, names->pdata[i]);
 
-    g_hash_table_iter_init(&iter, table);
-    g_variant_builder_init(&builder, G_VARIANT_TYPE_ARRAY);
-    while (g_hash_table_iter_next(&iter, &key, &value))
-    {
-        name = key;
-        dest = value;
-        logdebug("Found printer : %s\n", name);
-        info = cups_retrieve_string(dest, "printer-info");
-        location = cups_retrieve_string(dest, "printer-location");
-        make = cups_retrieve_string(dest, "printer-make-and-model");
-        accepting_jobs = cups_is_accepting_jobs(dest);
-        state = cups_printer_state(dest);
-        add_printer_to_dialog(b, dialog_name, dest);
-        char *printer_name = get_printer_name_for_cups_dest(dest);
-        printer = g_variant_new(CPDB_PRINTER_ARGS, printer_name, printer_name, info,
-                                location, make, accepting_jobs, state, BACKEND_NAME);
-        g_variant_builder_add(&builder, "(v)", printer);
-        g_free(printer_name);
-        free(key);
-        cupsFreeDests(1, value);
-        free(info);
-        free(location);
-        free(make);
+        logdebug("Found printer : %s\n", (char *)names->pdata[i]);
+        add_printer_to_dialog(b, dialog_name, e->dest);
+        g_variant_builder_add(&builder, "(v)", get_printer_entry_record(e));
+        (*num_printers)++;
     }
-    g_hash_table_destroy(table);
-    printers = g_variant_builder_end(&builder);
 
-    print_backend_complete_get_all_printers(interface, invocation, num_printers, printers);
-    return TRUE;
+    g_ptr_array_free(names, TRUE);
+    return g_variant_builder_end(&builder);
 }
 
-static gboolean on_handle_get_filtered_printer_list(PrintBackend *interface,
-                                           GDBusMethodInvocation *invocation,
-                                           gpointer user_data)
+static void complete_printer_listing(BackendObj *b, GHashTable *snapshot, gpointer user_data)
 {
+    ListingRequest *req = user_data;
+    const char *dialog_name = g_dbus_method_invocation_get_sender(req->invocation);
     int num_printers;
-    GHashTableIter iter;
-    gpointer key, value;
+    GVariant *printers;
+
+    printers = pack_printer_list(snapshot, dialog_name,
+                                 req->hide_temp, req->hide_remote, &num_printers);
+
+    /** The dialog is likely to ask for the options of one of these next;
+     * queued before replying, which releases dialog_name **/
+    prefetch_printer_capabilities(b, dialog_name);
+
+    if (req->filtered)
+        print_backend_complete_get_filtered_printer_list(req->interface, req->invocation,
+                                                         num_printers, printers);
+    else
+        print_backend_complete_get_all_printers(req->interface, req->invocation,
+                                                num_printers, printers);
+    g_free(req);
+}
+
+/**
+ * State of a streaming listing, owned by the thread running the enumeration.
+ */
+typedef struct
+{
+    StreamListing *listing;
+    /** printers found so far, in the same format as the printer snapshot **/
+    GHashTable *printers;
+    /** config change times fetched after the enumeration, set on the
+     * entries on the main thread, which shares them with the dialogs **/
+    GHashTable *stamps;
+} PrinterStream;
+
+typedef struct
+{
+    StreamListing *listing;
+    char *printer_name;
+    PrinterEntry *entry;
+} StreamedPrinter;
+
+static void free_PrinterStream(gpointer data)
+{
+    PrinterStream *stream = data;
+
+    unref_StreamListing(stream->listing);
+    g_hash_table_unref(stream->printers);
+    if (stream->stamps)
+        g_hash_table_unref(stream->stamps);
+    g_free(stream);
+}
+
+static void free_StreamedPrinter(gpointer data)
+{
+    StreamedPrinter *sp = data;
+
+    unref_StreamListing(sp->listing);
+    g_free(sp->printer_name);
+    unref_PrinterEntry(sp->entry);
+    g_free(sp);
+}
+
+static gboolean deliver_streamed_printer(gpointer user_data)
+{
+    StreamedPrinter *sp = user_data;
+
+    add_streamed_printer(b, sp->listing, sp->printer_name, sp->entry);
+    return G_SOURCE_REMOVE;
+}
+
+static void printers_streamed_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    PrinterStream *stream = g_task_get_task_data(G_TASK(res));
+
+    g_message("Exiting thread for dialog at %s\n", stream->listing->dialog_name);
+    if (stream->stamps)
+        set_config_stamps(stream->printers, stream->stamps);
+    install_streamed_snapshot(b, stream->listing, stream->printers);
+    prefetch_printer_capabilities(b, stream->listing->dialog_name);
+}
+
+/**
+ * Reply with an empty list right away and signal the printers to the
+ * dialog as they are discovered.
+ */
+static void stream_printer_listing(ListingRequest *req, const char *dialog_name)
+{
+    PrinterStream *stream;
+    GTask *task;
     GVariantBuilder builder;
-    GVariant *printer, *printers;
 
-    cups_dest_t *dest;
-    gboolean accepting_jobs;
-    const char *state;
-    char *name, *info, *location, *make;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(v)"));
+    if (req->filtered)
+        print_backend_complete_get_filtered_printer_list(req->interface, req->invocation,
+                                                         0, g_variant_builder_end(&builder));
+    else
+        print_backend_complete_get_all_printers(req->interface, req->invocation,
+                                                0, g_variant_builder_end(&builder));
+    g_free(req);
+
+    stream = g_new0(PrinterStream, 1);
+    stream->listing = start_dialog_listing(b, dialog_name);
+    stream->printers = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             (GDestroyNotify)free_string,
+                                             (GDestroyNotify)unref_PrinterEntry);
+
+    task = g_task_new(NULL, NULL, printers_streamed_cb, NULL);
+    g_task_set_task_data(task, stream, free_PrinterStream);
+    g_task_run_in_thread(task, list_printers);
+    g_object_unref(task);
+}
+
+static void request_printer_listing(ListingRequest *req, const char *dialog_name)
+{
+    if (b->stream_listing && b->printer_snapshot == NULL)
+        stream_printer_listing(req, dialog_name);
+    else
+        request_printer_snapshot(b, complete_printer_listing, req);
+}
 
+static gboolean on_handle_get_all_printers(PrintBackend *interface,
+                                           GDBusMethodInvocation *invocation,
+                                           gpointer user_data)
+{
     const char *dialog_name = g_dbus_method_invocation_get_sender(invocation);
-    GHashTable *table = cups_get_printers(get_hide_temp(b, dialog_name), get_hide_remote(b, dialog_name));
+    ListingRequest *req = g_new0(ListingRequest, 1);
 
     add_frontend(b, dialog_name);
-    num_printers = g_hash_table_size(table);
-    if (num_printers == 0)
-    {
-        printers = g_variant_new_array(G_VARIANT_TYPE ("(v)"), NULL, 0);
-        print_backend_complete_get_filtered_printer_list(interface, invocation, 0, printers);
-        return TRUE;
-    }
+    req->interface = interface;
+    req->invocation = invocation;
+    req->filtered = FALSE;
+    request_printer_listing(req, dialog_name);
+    return TRUE;
+}
 
-    g_hash_table_iter_init(&iter, table);
-    g_variant_builder_init(&builder, G_VARIANT_TYPE_ARRAY);
-    while (g_hash_table_iter_next(&iter, &key, &value))
-    {
-        name = key;
-        dest = value;
-        logdebug("Found printer : %s\n", name);
-        info = cups_retrieve_string(dest, "printer-info");
-        location = cups_retrieve_string(dest, "printer-location");
-        make = cups_retrieve_string(dest, "printer-make-and-model");
-        accepting_jobs = cups_is_accepting_jobs(dest);
-        state = cups_printer_state(dest);
-        add_printer_to_dialog(b, dialog_name, dest);
-        char *printer_name = get_printer_name_for_cups_dest(dest);
-        printer = g_variant_new(CPDB_PRINTER_ARGS, printer_name, printer_name, info,
-                                location, make, accepting_jobs, state, BACKEND_NAME);
-        g_variant_builder_add(&builder, "(v)", printer);
-        g_free(printer_name);
-        free(key);
-        cupsFreeDests(1, value);
-        free(info);
-        free(location);
-        free(make);
-    }
-    g_hash_table_destroy(table);
-    printers = g_variant_builder_end(&builder);
+static gboolean on_handle_get_filtered_printer_list(PrintBackend *interface,
+                                           GDBusMethodInvocation *invocation,
+                                           gpointer user_data)
+{
+    const char *dialog_name = g_dbus_method_invocation_get_sender(invocation);
+    ListingRequest *req = g_new0(ListingRequest, 1);
 
-    print_backend_complete_get_filtered_printer_list(interface, invocation, num_printers, printers);
+    req->interface = interface;
+    req->invocation = invocation;
+    req->filtered = TRUE;
+    req->hide_temp = get_hide_temp(b, dialog_name);
+    req->hide_remote = get_hide_remote(b, dialog_name);
+    add_frontend(b, dialog_name);
+    request_printer_listing(req, dialog_name);
     return TRUE;
 }
 
@@ -294,47 +477,72 @@ static gboolean on_handle_get_all_translations(PrintBackend *interface,
 
     dialog_name = g_dbus_method_invocation_get_sender(invocation);
     p = get_printer_by_name(b, dialog_name, printer_name);
-    translations = get_printer_translations(p, locale);
+    if (p == NULL)
+    {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                              "Unknown printer %s", printer_name);
+        return TRUE;
+    }
+    translations = get_cached_translations(b, p, locale);
     print_backend_complete_get_all_translations(interface, invocation, translations);
 
     return TRUE;
 }
 
-gpointer list_printers(gpointer _dialog_name)
+static void list_printers(GTask *task, gpointer source_object,
+                          gpointer task_data, GCancellable *cancellable)
 {
-    const char *dialog_name = (const char *)_dialog_name;
-    g_message("New thread for dialog at %s\n", dialog_name);
-    int *cancel = get_dialog_cancel(b, dialog_name);
+    PrinterStream *stream = task_data;
+    g_message("New thread for dialog at %s\n", stream->listing->dialog_name);
 
     cupsEnumDests(CUPS_DEST_FLAGS_NONE,
-                  -1, //NO timeout
-                  cancel,
+                  3000, //timeout in ms for the network printers
+                  &stream->listing->cancel,
                   0, //TYPE
                   0, //MASK
                   send_printer_added,
-                  _dialog_name);
+                  stream);
+    if (!g_atomic_int_get(&stream->listing->cancel))
+        stream->stamps = fetch_config_stamps(NULL);
 
-    g_message("Exiting thread for dialog at %s\n", dialog_name);
-    return NULL;
+    g_task_return_boolean(task, TRUE);
 }
 
-int send_printer_added(void *_dialog_name, unsigned flags, cups_dest_t *dest)
+int send_printer_added(void *_stream, unsigned flags, cups_dest_t *dest)
 {
+    PrinterStream *stream = _stream;
+    StreamedPrinter *sp;
+    char *printer_name;
 
-    const char *dialog_name = (const char *)_dialog_name;
-    char *printer_name = get_printer_name_for_cups_dest(dest);
+    if (g_atomic_int_get(&stream->listing->cancel))
+        return 0;
+    if (flags & CUPS_DEST_FLAGS_REMOVED)
+        return 1;
 
-    if (dialog_contains_printer(b, dialog_name, printer_name))
+    printer_name = get_printer_name_for_cups_dest(dest);
+    if (g_hash_table_contains(stream->printers, printer_name))
     {
         g_message("%s already sent.\n", printer_name);
+        g_free(printer_name);
         return 1;
     }
 
-    add_printer_to_dialog(b, dialog_name, dest);
-    send_printer_added_signal(b, dialog_name, dest);
-    g_message("     Sent notification for printer %s\n", printer_name);
-
-    g_free(printer_name);
+    /** The entry is classified here, off the main thread, and handed
+     * to the main loop, which owns the dialogs
+     */
+    sp = g_new(StreamedPrinter, 1);
+    sp->entry = get_new_PrinterEntry(dest);
+    if (sp->entry == NULL)
+    {
+        g_free(sp);
+        g_free(printer_name);
+        return 1;
+    }
+    sp->listing = ref_StreamListing(stream->listing);
+    sp->printer_name = g_strdup(printer_name);
+    g_hash_table_insert(stream->printers, printer_name, ref_PrinterEntry(sp->entry));
+    g_main_context_invoke_full(NULL, G_PRIORITY_DEFAULT,
+                               deliver_streamed_printer, sp, free_StreamedPrinter);
 
     /** dest will be automatically freed later. 
      * Don't explicitly free it
@@ -342,6 +550,44 @@ int send_printer_added(void *_dialog_name, unsigned flags, cups_dest_t *dest)
     return 1; //continue enumeration
 }
 
+static gboolean linger_timeout_cb(gpointer user_data)
+{
+    b->linger_source = 0;
+    g_message("No frontends connected for %u seconds .. exiting backend.\n",
+              b->linger_timeout);
+    g_main_loop_quit(loop);
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * The last dialog is gone. Keep the connections, the subscription and the
+ * caches around for a while, as dialogs tend to be opened again soon,
+ * unless lingering is disabled or the process has grown too big.
+ */
+static void start_lingering()
+{
+    gsize memory = get_resident_memory();
+
+    if (b->linger_timeout == 0)
+    {
+        g_message("No frontends connected .. exiting backend.\n");
+        g_main_loop_quit(loop);
+        return;
+    }
+    if (b->linger_max_memory && memory > b->linger_max_memory)
+    {
+        g_message("No frontends connected, using %" G_GSIZE_FORMAT " bytes .. exiting backend.\n",
+                  memory);
+        g_main_loop_quit(loop);
+        return;
+    }
+
+    logdebug("No frontends connected, lingering for %u seconds\n", b->linger_timeout);
+    if (b->linger_source)
+        g_source_remove(b->linger_source);
+    b->linger_source = g_timeout_add_seconds(b->linger_timeout, linger_timeout_cb, NULL);
+}
+
 static void on_handle_do_listing(PrintBackend *interface,
                                     GDBusMethodInvocation *invocation,
                                     gboolean is_listed,
@@ -357,10 +603,7 @@ static void on_handle_do_listing(PrintBackend *interface,
         set_dialog_cancel(b, dialog_name);
         remove_frontend(b, dialog_name);
         if (no_frontends(b))
-        {
-            g_message("No frontends connected .. exiting backend.\n");
-            exit(EXIT_SUCCESS);
-        }
+            start_lingering();
     }
 }
 
@@ -479,9 +722,9 @@ static gboolean on_handle_get_group_translation(PrintBackend *interface,
                                                 const gchar *locale,
                                                 gpointer user_data)
 {
-    char *translation = cpdbGetGroupTranslation2(group_name, locale);
+    char *translation = get_group_translation(group_name, locale);
     print_backend_complete_get_group_translation(interface, invocation, translation);
-    free(translation);
+    g_free(translation);
     return TRUE;
 }
 
@@ -511,6 +754,7 @@ static gboolean on_handle_print_socket(PrintBackend *interface,
     char jobid[32];
     char socket[256];
     print_socket(p, num_settings, settings, jobid, socket, title);
+    record_printer_use(b, printer_id, TRUE);
 
     // Complete the D-Bus method call with the result
     print_backend_complete_print_socket(interface, invocation, jobid, socket);
@@ -518,43 +762,114 @@ static gboolean on_handle_print_socket(PrintBackend *interface,
     return TRUE;
 }
 
+static void reply_all_options(BackendObj *b, gpointer user_data)
+{
+    GDBusMethodInvocation *invocation = user_data;
+    const char *dialog_name = g_dbus_method_invocation_get_sender(invocation); /// potential risk
+    const gchar *printer_name;
+    PrinterCUPS *p;
+
+    g_variant_get(g_dbus_method_invocation_get_parameters(invocation), "(&s)", &printer_name);
+    p = get_printer_by_name(b, dialog_name, printer_name);
+    if (p == NULL)
+    {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                              "Unknown printer %s", printer_name);
+        return;
+    }
+
+    PrinterCapabilities *caps = get_printer_capabilities(b, p);
+    record_printer_use(b, printer_name, FALSE);
+
+    /** Every dialog asking for this printer gets the same serialized reply **/
+    g_dbus_method_invocation_return_value(invocation, get_capabilities_reply(caps));
+}
+
 static gboolean on_handle_get_all_options(PrintBackend *interface,
                                           GDBusMethodInvocation *invocation,
                                           const gchar *printer_name,
                                           gpointer user_data)
 {
-    const char *dialog_name = g_dbus_method_invocation_get_sender(invocation); /// potential risk
+    /** A prefetch of the printer may be about to bring the options **/
+    when_prefetch_done(b, printer_name, reply_all_options, invocation);
+    return TRUE;
+}
+
+static gboolean on_handle_get_options(CupsExtensions *interface,
+                                      GDBusMethodInvocation *invocation,
+                                      const gchar *printer_name,
+                                      const gchar *const *option_names,
+                                      gpointer user_data)
+{
+    const char *dialog_name = g_dbus_method_invocation_get_sender(invocation);
     PrinterCUPS *p = get_printer_by_name(b, dialog_name, printer_name);
-    
-    Media *medias;
-    int media_count = get_all_media(p, &medias);
-    GVariantBuilder *builder;
-    GVariant *media_variant;
-    builder = g_variant_builder_new(G_VARIANT_TYPE("a(siiia(iiii))"));
-    
-    for (int i = 0; i < media_count; i++)
+
+    if (p == NULL)
     {
-		GVariant *tuple = pack_media(&medias[i]);
-		g_variant_builder_add_value(builder, tuple);
-	}
-	media_variant = g_variant_builder_end(builder);
-    
-    Option *options;
-    int count = get_all_options(p, &options);
-    count = add_media_to_options(p, medias, media_count, &options, count);
-    GVariant *variant;
-    builder = g_variant_builder_new(G_VARIANT_TYPE("a(sssia(s))"));
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                              "Unknown printer %s", printer_name);
+        return TRUE;
+    }
+
+    g_dbus_method_invocation_return_value(invocation,
+                                          get_selected_options_reply(b, p, option_names));
+    return TRUE;
+}
+
+static void reply_all_options_conditional(BackendObj *b, gpointer user_data)
+{
+    GDBusMethodInvocation *invocation = user_data;
+    const char *dialog_name = g_dbus_method_invocation_get_sender(invocation);
+    const gchar *printer_name, *etag;
+    PrinterCUPS *p;
+    PrinterCapabilities *caps;
+    const char *current;
+    int num_options, num_media;
+    GVariant *options, *media;
 
-    for (int i = 0; i < count; i++)
+    g_variant_get(g_dbus_method_invocation_get_parameters(invocation), "(&s&s)",
+                  &printer_name, &etag);
+    p = get_printer_by_name(b, dialog_name, printer_name);
+    if (p == NULL)
     {
-        GVariant *tuple = pack_option(&options[i]);
-        g_variant_builder_add_value(builder, tuple);
-        //g_variant_unref(tuple);
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                              "Unknown printer %s", printer_name);
+        return;
     }
-    variant = g_variant_builder_end(builder);
-    
-    print_backend_complete_get_all_options(interface, invocation, count, variant, media_count, media_variant);
-    free_options(count, options);
+
+    caps = get_printer_capabilities(b, p);
+    record_printer_use(b, printer_name, FALSE);
+    current = get_capabilities_etag(caps);
+    if (g_strcmp0(etag, current) == 0)
+    {
+        logdebug("Options of %s not modified for %s\n", printer_name, dialog_name);
+        g_dbus_method_invocation_return_value(invocation,
+                                              g_variant_new("(bsi@a(sssia(s))i@a(siiia(iiii)))",
+                                                            FALSE, current,
+                                                            0, g_variant_new_array(G_VARIANT_TYPE("(sssia(s))"), NULL, 0),
+                                                            0, g_variant_new_array(G_VARIANT_TYPE("(siiia(iiii))"), NULL, 0)));
+        return;
+    }
+
+    /** The children of the shared reply, no repacking **/
+    g_variant_get(get_capabilities_reply(caps), "(i@a(sssia(s))i@a(siiia(iiii)))",
+                  &num_options, &options, &num_media, &media);
+    g_dbus_method_invocation_return_value(invocation,
+                                          g_variant_new("(bsi@a(sssia(s))i@a(siiia(iiii)))",
+                                                        TRUE, current,
+                                                        num_options, options,
+                                                        num_media, media));
+    g_variant_unref(options);
+    g_variant_unref(media);
+}
+
+static gboolean on_handle_get_all_options_conditional(CupsExtensions *interface,
+                                                     GDBusMethodInvocation *invocation,
+                                                     const gchar *printer_name,
+                                                     const gchar *etag,
+                                                     gpointer user_data)
+{
+    when_prefetch_done(b, printer_name, reply_all_options_conditional, invocation);
     return TRUE;
 }
 
@@ -665,5 +980,13 @@ void connect_to_signals()
                      "handle-get-all-translations",
                      G_CALLBACK(on_handle_get_all_translations),
                      NULL);
+    g_signal_connect(b->extensions,                        //instance
+                     "handle-get-options",                 //signal name
+                     G_CALLBACK(on_handle_get_options),    //callback
+                     NULL);
+    g_signal_connect(b->extensions,                                          //instance
+                     "handle-get-all-options-conditional",                   //signal name
+                     G_CALLBACK(on_handle_get_all_options_conditional),      //callback
+                     NULL);
     
 }